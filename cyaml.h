@@ -14,11 +14,55 @@
 #ifndef CYAML_H_
 #define CYAML_H_
 
+/* the mains of CYAML_FUZZ, CYAML_STRESS, CYAML_BENCH and CYAML_CHECK
+ * need POSIX (clock_gettime, strdup, sysconf, mkstemp), which strict C
+ * modes hide */
+#if (defined(CYAML_FUZZ) || defined(CYAML_STRESS) || defined(CYAML_BENCH) || defined(CYAML_CHECK)) \
+	&& defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif /* CYAML_FUZZ */
+
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef CYAML_THREADS
+#include <pthread.h>
+#endif /* CYAML_THREADS */
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif /* __linux__ */
+
+#ifdef CYAML_FUZZ
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
+#endif /* CYAML_FUZZ */
+
+#ifdef CYAML_STRESS
+#include <time.h>
+#include <unistd.h>
+#endif /* CYAML_STRESS */
+
+#ifdef CYAML_BENCH
+#include <time.h>
+#endif /* CYAML_BENCH */
+
+#ifdef CYAML_CHECK
+#include <unistd.h>
+#endif /* CYAML_CHECK */
+
 #ifndef CYAMLDEF
 #ifdef CYAMLSTATIC
 #define CYAMLDEF static
@@ -27,6 +71,10 @@
 #endif /* CYAMLSTATIC */
 #endif /* CYAMLDEF */
 
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
 #if !defined(CYAML_MALLOC) || !defined(CYAML_REALLOC) || !defined(CYAML_CALLOC) || !defined(CYAML_FREE)
 #define CYAML_MALLOC(sz) malloc(sz)
 #define CYAML_REALLOC(x, newsz) realloc(x, newsz)
@@ -38,10 +86,213 @@
 #define CYAML_LOG_STACK_CAPACITY   (20)  /* maximum life span of a message in the cyaml logging
 					  *  system */
 
+#ifndef CYAML_MAX_DEPTH
+#define CYAML_MAX_DEPTH (512)            /* default nesting limit, keeps the recursive walks
+					  *  of a document well within the stack */
+#endif /* CYAML_MAX_DEPTH */
+
+#ifndef CYAML_INDENT_STACK
+#define CYAML_INDENT_STACK (32)          /* indentation levels and open blocks the parser
+					  *  tracks before its stacks grow on the arena */
+#endif /* CYAML_INDENT_STACK */
+
+#ifndef CYAML_TOKEN_RING
+#define CYAML_TOKEN_RING (64)            /* tokens the tokenizer reads ahead of the parser
+					  *  at a time, a power of 2 */
+#endif /* CYAML_TOKEN_RING */
+
+#ifndef CYAML_MAX_BYTES
+#define CYAML_MAX_BYTES (SIZE_MAX)       /* default size limit of a document */
+#endif /* CYAML_MAX_BYTES */
+
+#ifndef CYAML_MAX_NODES
+#define CYAML_MAX_NODES (SIZE_MAX)       /* default limit of nodes in a document */
+#endif /* CYAML_MAX_NODES */
+
+#ifndef CYAML_MAX_SCALAR
+#define CYAML_MAX_SCALAR (SIZE_MAX)      /* default length limit of a scalar or a key */
+#endif /* CYAML_MAX_SCALAR */
+
+#ifndef CYAML_MAX_PATH
+#define CYAML_MAX_PATH (4096)            /* longest path of a file read, including the
+					  *  terminating nul */
+#endif /* CYAML_MAX_PATH */
+
+#ifndef CYAML_MAX_VAR_NAME
+#define CYAML_MAX_VAR_NAME (255)         /* longest name of an environment variable */
+#endif /* CYAML_MAX_VAR_NAME */
+
+#ifndef CYAML_MAX_EXPANSION
+#define CYAML_MAX_EXPANSION (1 << 20)    /* default limit of nodes a document reaches through
+					  *  files it includes more than once */
+#endif /* CYAML_MAX_EXPANSION */
+
+#ifndef CYAML_ALIGN
+#define CYAML_ALIGN (16)                 /* alignment of allocations inside of a caller's buffer */
+#endif /* CYAML_ALIGN */
+
+#ifndef CYAML_CHUNK_SIZE
+#define CYAML_CHUNK_SIZE (1 << 12)       /* first chunk that a document is allocated from */
+#endif /* CYAML_CHUNK_SIZE */
+
+#ifndef CYAML_CHUNK_MAX
+#define CYAML_CHUNK_MAX (1 << 20)        /* chunks stop doubling in size at this size */
+#endif /* CYAML_CHUNK_MAX */
+
+#ifndef CYAML_RETAIN_MAX
+#define CYAML_RETAIN_MAX (1 << 26)       /* bytes of chunks that 'cyaml_recycle' keeps around */
+#endif /* CYAML_RETAIN_MAX */
+
+#ifndef CYAML_RECLAIM_QUEUE
+#define CYAML_RECLAIM_QUEUE (64)         /* documents waiting for the reclaimer thread */
+#endif /* CYAML_RECLAIM_QUEUE */
+
+#ifndef CYAML_HUGE_PAGE_SIZE
+#define CYAML_HUGE_PAGE_SIZE (1 << 21)   /* size of a huge page, chunks backed by them are
+					  *  multiples of it */
+#endif /* CYAML_HUGE_PAGE_SIZE */
+
+#ifndef CYAML_NUMA_NODES
+#define CYAML_NUMA_NODES (1024)          /* NUMA nodes that 'cyaml_replicate' can bind to */
+#endif /* CYAML_NUMA_NODES */
+
+#ifndef CYAML_CACHE_MAX
+#define CYAML_CACHE_MAX ((size_t) 1 << 30) /* largest image in the parse cache, also the
+					    *  distance between the addresses images are
+					    *  placed at */
+#endif /* CYAML_CACHE_MAX */
+
+#ifndef CYAML_CACHE_BASE
+#define CYAML_CACHE_BASE ((uint64_t) 1 << 45) /* lowest address of a cached image, 64-bit
+					       *  only */
+#endif /* CYAML_CACHE_BASE */
+
+#ifndef CYAML_CACHE_SLOTS
+#define CYAML_CACHE_SLOTS (4096)         /* addresses above CYAML_CACHE_BASE picked from by
+					  *  the hash of the input */
+#endif /* CYAML_CACHE_SLOTS */
+
+#ifndef CYAML_HASHING
+#define CYAML_HASHING (CYAML_HASH_64)    /* node hashes computed unless the options say otherwise */
+#endif /* CYAML_HASHING */
+
+#ifndef CYAML_HASH_BLOCK
+#define CYAML_HASH_BLOCK (64)            /* items or entries summed up into one hash for
+					  *  'cyaml_diff' to skip at once */
+#endif /* CYAML_HASH_BLOCK */
+
+#ifndef CYAML_FREEZE_THRESHOLD
+#define CYAML_FREEZE_THRESHOLD (8)       /* smallest mapping that 'cyaml_freeze' builds a perfect
+					  *  hash for */
+#endif /* CYAML_FREEZE_THRESHOLD */
+
+#ifndef CYAML_FREEZE_ATTEMPTS
+#define CYAML_FREEZE_ATTEMPTS (1 << 16)  /* displacements tried per bucket before another seed
+					  *  is picked */
+#endif /* CYAML_FREEZE_ATTEMPTS */
+
+#ifndef CYAML_FUZZ_RUNS
+#define CYAML_FUZZ_RUNS (5)              /* timings of a corpus input, the median is kept */
+#endif /* CYAML_FUZZ_RUNS */
+
+#ifndef CYAML_FUZZ_SAMPLE
+#define CYAML_FUZZ_SAMPLE (2e6)          /* ns a timing parses an input for, repeatedly if it
+					  *  is quicker than that */
+#endif /* CYAML_FUZZ_SAMPLE */
+
+#ifndef CYAML_FUZZ_SIZES
+#define CYAML_FUZZ_SIZES (4)             /* prefixes of a corpus input that are timed, halving
+					  *  from the whole input down */
+#endif /* CYAML_FUZZ_SIZES */
+
+#ifndef CYAML_FUZZ_MIN_SIZE
+#define CYAML_FUZZ_MIN_SIZE (4096)       /* smaller corpus inputs are parsed but not timed */
+#endif /* CYAML_FUZZ_MIN_SIZE */
+
+#ifndef CYAML_FUZZ_SLOWDOWN
+#define CYAML_FUZZ_SLOWDOWN (10.0)       /* slowest time per byte allowed, relative to the
+					  *  median of the corpus */
+#endif /* CYAML_FUZZ_SLOWDOWN */
+
+#ifndef CYAML_FUZZ_GROWTH
+#define CYAML_FUZZ_GROWTH (1.75)         /* slope of parse time over size allowed on a log-log
+					  *  scale (1 linear, 2 quadratic), see 'cyaml_fuzz_measure' */
+#endif /* CYAML_FUZZ_GROWTH */
+
+#ifndef CYAML_LOAD_STEP
+#define CYAML_LOAD_STEP (1 << 16)        /* bytes 'cyaml_load_read' reads and 'cyaml_load_step'
+					  *  parses per call */
+#endif /* CYAML_LOAD_STEP */
+
+#ifndef CYAML_PIPELINE_CHUNK
+#define CYAML_PIPELINE_CHUNK (1 << 20)   /* bytes the reader of a pipelined parse reads at
+					  *  once, see 'cyaml_parse_opts' */
+#endif /* CYAML_PIPELINE_CHUNK */
+
+#ifndef CYAML_LOOKUP_CACHE
+#define CYAML_LOOKUP_CACHE (0)           /* lookups every thread remembers, a power of 2,
+					  *  0 leaves 'cyaml_lookup' without a cache */
+#endif /* CYAML_LOOKUP_CACHE */
+
+#ifndef CYAML_LOOKUP_CACHE_PATH
+#define CYAML_LOOKUP_CACHE_PATH (32)     /* longer paths are never remembered, including
+					  *  the terminating nul */
+#endif /* CYAML_LOOKUP_CACHE_PATH */
+
+#ifndef CYAML_STRESS_LOOKUPS
+#define CYAML_STRESS_LOOKUPS (1 << 20)   /* lookups every thread of the stress test makes
+					  *  per round */
+#endif /* CYAML_STRESS_LOOKUPS */
+
+#ifndef CYAML_STRESS_PATH
+#define CYAML_STRESS_PATH (4096)         /* longest path the stress test looks up */
+#endif /* CYAML_STRESS_PATH */
+
+#ifndef CYAML_BENCH_LOOKUPS
+#define CYAML_BENCH_LOOKUPS (1 << 22)   /* lookups the benchmark times per mapping, before
+					  *  and after freezing it */
+#endif /* CYAML_BENCH_LOOKUPS */
+
+#ifndef CYAML_CHECK_INPUTS
+#define CYAML_CHECK_INPUTS (20000)      /* random documents the differential check parses
+					  *  every way there is */
+#endif /* CYAML_CHECK_INPUTS */
+
+#ifndef CYAML_CHECK_REPORTS
+#define CYAML_CHECK_REPORTS (20)        /* failed checks reported, the rest are counted */
+#endif /* CYAML_CHECK_REPORTS */
+
+#ifndef CYAML_CHECK_CACHE
+#define CYAML_CHECK_CACHE (1)           /* 0 skips the parse cache check, as ThreadSanitizer
+					  *  refuses to map images at CYAML_CACHE_BASE */
+#endif /* CYAML_CHECK_CACHE */
+
+/**
+ * A node of the document. Scalars keep their (nul-terminated) text in
+ * 'storage.scalar' with 'size' being its length, lists keep 'size'
+ * items and mappings keep 'size' key/value pairs, indexed by the
+ * ternary search trie in 'index'.
+ */
 typedef struct cyaml_t {
+	enum cyaml_storage_type {
+		CYAML_STORAGE_SCALAR,
+		CYAML_STORAGE_LIST,
+		CYAML_STORAGE_MAPPING
+	} type;
+	int root; /* non-zero on the root node of a document */
+
 	size_t size;
 	size_t capacity;
-	struct cyaml_dict_t *data;
+	union {
+		char *scalar;
+		struct cyaml_t **items;
+		struct cyaml_dict_t *data;
+	} storage;
+	struct cyaml_trie_t *index;
+	struct cyaml_phash_t *perfect;
+	uint64_t hash; /* of the content of the node and everything below it, 0 if not hashed */
+	uint64_t hash_high; /* upper half of a 128-bit hash */
+	uint64_t *blocks; /* hashes of every CYAML_HASH_BLOCK items or entries, NULL if fewer */
 } cyaml_t;
 
 typedef struct cyaml_trie_t {
@@ -50,21 +301,26 @@ typedef struct cyaml_trie_t {
 	struct cyaml_trie_t *children;
 	struct cyaml_trie_t *right;
 
-	size_t size;
-	size_t capacity;
-	struct cyaml_cyaml_t *lists;
+	size_t index; /* 1 + the index of the key ending here, 0 if none */
 } cyaml_trie_t;
 
-typedef struct cyaml_dict_t {
-	enum cyaml_storage_type {
-		CYAML_STORAGE_LIST,
-		CYAML_STORAGE_MAPPING
-	} type;
+/**
+ * A minimal perfect hash over the keys of a frozen mapping, the key
+ * hashing to bucket 'b' lives at entry 'slots[slot]' where the slot is
+ * picked by the displacement of 'b'.
+ */
+typedef struct cyaml_phash_t {
+	uint64_t seed;
+	size_t buckets;
+	uint32_t *displacements;
+	uint32_t *slots;
+} cyaml_phash_t;
 
-	union {
-		struct cyaml_t *keys;
-		struct trie_t *list;
-	} storage;
+typedef struct cyaml_dict_t {
+	size_t len;
+	char *key;
+	struct cyaml_t *value;
+	uint64_t hash; /* of the key and the value */
 } cyaml_dict_t;
 
 typedef enum cyaml_loc_t {
@@ -72,25 +328,355 @@ typedef enum cyaml_loc_t {
 	CYAML_LOC_DISK
 } cyaml_loc_t;
 
+/**
+ * What the memory of a document is backed with. Huge pages need Linux,
+ * elsewhere the document is allocated with CYAML_MALLOC as usual.
+ */
+enum cyaml_pages {
+	CYAML_PAGES_DEFAULT,     /* CYAML_MALLOC */
+	CYAML_PAGES_TRANSPARENT, /* mappings advised to use transparent huge pages */
+	CYAML_PAGES_HUGETLB      /* reserved huge pages, or transparent ones if there are none */
+};
+
+/**
+ * Whether a content hash of every node is computed while parsing, see
+ * 'cyaml_node_hash'. Hashes let 'cyaml_diff' skip equal subtrees.
+ */
+enum cyaml_hashing {
+	CYAML_HASH_DEFAULT, /* CYAML_HASHING */
+	CYAML_HASH_NONE,
+	CYAML_HASH_64,
+	CYAML_HASH_128
+};
+
+/**
+ * Options of 'cyaml_parse_opts'. Limits left at 0 take the defaults of
+ * the CYAML_MAX_* macros, SIZE_MAX lifts them; a parse exceeding one of
+ * them fails.
+ */
+typedef struct cyaml_options_t {
+	size_t max_depth;  /* nesting of lists and mappings */
+	size_t max_bytes;  /* size of the document */
+	size_t max_nodes;  /* scalars, lists and mappings */
+	size_t max_scalar; /* length of a scalar or a key */
+	void *buffer;      /* parse into this memory instead of the heap */
+	size_t buffer_size;
+	enum cyaml_pages pages;
+	enum cyaml_hashing hash;
+	char *cache;       /* directory of the shared parse cache, see 'cyaml_parse_opts' */
+	int share;         /* store equal subtrees once, see 'cyaml_parse_opts' */
+	int expand;        /* resolve ${VAR} and !include, see 'cyaml_parse_opts' */
+	int pipeline;      /* read files on a thread of their own while parsing them */
+	size_t max_expansion; /* nodes of repeated includes, see 'cyaml_parse_opts' */
+} cyaml_options_t;
+
+/**
+ * Where and why 'cyaml_validate' rejected a document, 'line' and
+ * 'column' counting from 1.
+ */
+typedef struct cyaml_error_t {
+	const char *message;
+	size_t line;
+	size_t column;
+} cyaml_error_t;
+
+/**
+ * The kinds of tokens of a document. Every line starts with EMPTY if it
+ * is indented like the innermost open level, INDENT if it is indented
+ * further (opening a level), or an UNDENT for every level it closes
+ * followed by one of the two. The content following a dash counts as a
+ * line of its own, and the end of the document closes every level.
+ */
+enum cyaml_token_type {
+	CYAML_TOKEN_EMPTY,
+	CYAML_TOKEN_COLON,
+	CYAML_TOKEN_STRING,
+	CYAML_TOKEN_SYMBOL,
+	CYAML_TOKEN_INDENT,
+	CYAML_TOKEN_UNDENT,
+	CYAML_TOKEN_DASH,
+	CYAML_TOKEN_END,
+	CYAML_TOKEN_ERROR,
+};
+
+/**
+ * A token as 'cyaml_tokenize' reports it, 16 bytes. 'offset' is where
+ * it starts in the document (for a string, past its opening quote) and
+ * 'len' is the length of a string or symbol, or the indentation of the
+ * line for EMPTY, INDENT and UNDENT.
+ */
+typedef struct cyaml_lexeme_t {
+	uint32_t type; /* enum cyaml_token_type */
+	uint32_t len;
+	uint64_t offset;
+} cyaml_lexeme_t;
+
+/**
+ * A token as 'cyaml_tokenize_packed' reports it, 8 bytes: 'offset' as
+ * for 'cyaml_lexeme_t', and 'info' holding the type in its low 8 bits
+ * and the length in the high 24.
+ */
+typedef struct cyaml_packed_t {
+	uint32_t offset;
+	uint32_t info;
+} cyaml_packed_t;
+
+#define CYAML_PACKED_TYPE(token) ((enum cyaml_token_type) ((token).info & 0xff))
+#define CYAML_PACKED_LEN(token) ((token).info >> 8)
+#define CYAML_PACKED_WIDE (0xffffff) /* length of no packed token, which is at least 16 MB */
+
+typedef struct cyaml_tokenizer_t cyaml_tokenizer_t;
+
+/**
+ * What a function doing its work a step at a time returns, CYAML_AGAIN
+ * asking to be called again.
+ */
+enum cyaml_status {
+	CYAML_FAILED,
+	CYAML_DONE,
+	CYAML_AGAIN
+};
+
+typedef struct cyaml_load_t cyaml_load_t;
+typedef struct cyaml_parse_t cyaml_parse_t;
+
+/**
+ * A columnar view of a list of mappings that all share the same keys
+ * and only hold scalar values. The values of every column are stored
+ * one after another in 'values' (nul-terminated), the value of row 'i'
+ * starting at 'values + offsets[i]', so scanning a single key of every
+ * row is a linear sweep through memory.
+ */
+typedef struct cyaml_column_t {
+	size_t len;
+	char *key;
+	char *values;
+	size_t *offsets; /* rows + 1 offsets into 'values' */
+} cyaml_column_t;
+
+typedef struct cyaml_columns_t {
+	size_t rows;
+	size_t size;
+	struct cyaml_column_t *columns;
+	size_t pool_size;
+	char *pool;
+} cyaml_columns_t;
+
+#define CYAML_COLUMN_VALUE(column, row) ((column)->values + (column)->offsets[row])
+#define CYAML_COLUMN_LENGTH(column, row) ((column)->offsets[(row) + 1] - (column)->offsets[row] - 1)
+
+CYAMLDEF const char *
+cyaml_error_pop(void);
+
 CYAMLDEF cyaml_t *
 cyaml_parse(char *s, size_t n, cyaml_loc_t loc);
 
+CYAMLDEF cyaml_t *
+cyaml_parse_opts(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options);
+
+CYAMLDEF size_t
+cyaml_parse_size(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options);
+
+CYAMLDEF int
+cyaml_validate(char *s, size_t n, cyaml_error_t *error);
+
+CYAMLDEF cyaml_tokenizer_t *
+cyaml_tokenizer_create(char *s, size_t n);
+
+CYAMLDEF size_t
+cyaml_tokenize(cyaml_tokenizer_t *tokenizer, cyaml_lexeme_t *tokens, size_t cap);
+
+CYAMLDEF size_t
+cyaml_tokenize_packed(cyaml_tokenizer_t *tokenizer, cyaml_packed_t *tokens, size_t cap);
+
+CYAMLDEF void
+cyaml_tokenizer_free(cyaml_tokenizer_t *tokenizer);
+
+CYAMLDEF cyaml_load_t *
+cyaml_load_create(cyaml_options_t *options);
+
+CYAMLDEF char *
+cyaml_load_buffer(cyaml_load_t *load, size_t *size);
+
+CYAMLDEF int
+cyaml_load_commit(cyaml_load_t *load, size_t n);
+
+CYAMLDEF enum cyaml_status
+cyaml_load_read(cyaml_load_t *load, int fd);
+
+CYAMLDEF enum cyaml_status
+cyaml_load_step(cyaml_load_t *load);
+
+CYAMLDEF cyaml_t *
+cyaml_load_finish(cyaml_load_t *load);
+
+CYAMLDEF cyaml_parse_t *
+cyaml_parse_begin(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options);
+
+CYAMLDEF enum cyaml_status
+cyaml_parse_step(cyaml_parse_t *parse, size_t budget);
+
+CYAMLDEF cyaml_t *
+cyaml_parse_finish(cyaml_parse_t *parse);
+
 CYAMLDEF cyaml_t *
 cyaml_lookup(cyaml_t *cyaml, char *path);
 
 CYAMLDEF void
 cyaml_free(cyaml_t *cyaml);
 
+CYAMLDEF int
+cyaml_freeze(cyaml_t *cyaml);
+
+CYAMLDEF void
+cyaml_recycle(cyaml_t *cyaml);
+
+CYAMLDEF void
+cyaml_trim(void);
+
+CYAMLDEF cyaml_t *
+cyaml_replicate(cyaml_t *cyaml, int node);
+
+CYAMLDEF int
+cyaml_numa_node(void);
+
+#ifdef CYAML_THREADS
+CYAMLDEF int
+cyaml_reclaimer_start(void);
+
+CYAMLDEF void
+cyaml_reclaimer_stop(void);
+#endif /* CYAML_THREADS */
+
+CYAMLDEF cyaml_columns_t *
+cyaml_columns(cyaml_t *list);
+
+CYAMLDEF cyaml_column_t *
+cyaml_column(cyaml_columns_t *columns, char *key);
+
+CYAMLDEF void
+cyaml_columns_free(cyaml_columns_t *columns);
+
+/**
+ * Called for every matching key of a mapping, in lexicographic order of
+ * the keys. Returning non-zero stops the iteration, and is what the
+ * iterating function returns.
+ */
+typedef int (*cyaml_foreach_fn)(cyaml_dict_t *entry, void *data);
+
+/**
+ * Called for every difference found by 'cyaml_diff', 'old_node' being
+ * NULL for an added path and 'new_node' being NULL for a removed one.
+ * Returning non-zero stops the diff, and is what 'cyaml_diff' returns.
+ */
+enum cyaml_diff_op {
+	CYAML_DIFF_ADDED,
+	CYAML_DIFF_REMOVED,
+	CYAML_DIFF_CHANGED
+};
+
+typedef int (*cyaml_diff_fn)(enum cyaml_diff_op op, char *path, cyaml_t *old_node,
+			     cyaml_t *new_node, void *data);
+
+CYAMLDEF int
+cyaml_foreach_prefix(cyaml_t *cyaml, char *prefix, cyaml_foreach_fn fn, void *data);
+
+CYAMLDEF int
+cyaml_foreach_range(cyaml_t *cyaml, char *first, char *last, cyaml_foreach_fn fn, void *data);
+
+CYAMLDEF uint64_t
+cyaml_node_hash(cyaml_t *cyaml, uint64_t *high);
+
+CYAMLDEF int
+cyaml_diff(cyaml_t *old_node, cyaml_t *new_node, cyaml_diff_fn fn, void *data);
+
+/**
+ * A compiled query, made of the steps of expressions like
+ * 'services[?enabled=true].port', 'hosts[*].region', 'items[1:3]' or
+ * 'service*', where a key ending with '*' matches every key with that
+ * prefix and '[?path=value]' ('!=' negates) keeps the items of a list
+ * (or the node itself) whose 'path' holds 'value'. Keys containing
+ * dots or brackets can be quoted with '"', so '"service."*' matches
+ * every key starting with 'service.'.
+ */
+typedef struct cyaml_query_step_t {
+	enum cyaml_query_op {
+		CYAML_QUERY_KEY,
+		CYAML_QUERY_PREFIX,
+		CYAML_QUERY_INDEX,
+		CYAML_QUERY_SLICE,
+		CYAML_QUERY_FILTER
+	} op;
+
+	size_t len;
+	char *key;
+	char *value;
+	int negate;
+	long first, last;
+} cyaml_query_step_t;
+
+typedef struct cyaml_query_t {
+	size_t size;
+	struct cyaml_query_step_t *steps;
+} cyaml_query_t;
+
+/**
+ * Called for every node matched by a query, returning non-zero stops
+ * the query.
+ */
+typedef int (*cyaml_query_fn)(cyaml_t *cyaml, void *data);
+
+CYAMLDEF cyaml_query_t *
+cyaml_query_compile(char *query);
+
+CYAMLDEF int
+cyaml_query(cyaml_query_t *query, cyaml_t *cyaml, cyaml_query_fn fn, void *data);
+
+CYAMLDEF void
+cyaml_query_free(cyaml_query_t *query);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #ifdef CYAML_IMPLEMENTATION
 
+#if defined(__linux__) && defined(MAP_ANONYMOUS) && defined(SYS_mbind)
+#define CYAML_HAVE_MMAP
+#define CYAML_MPOL_BIND (2)
+#endif /* __linux__ */
+
+#if defined(CYAML_THREADS) && defined(__linux__) && defined(POSIX_FADV_WILLNEED)
+#define CYAML_HAVE_PIPELINE
+#endif /* CYAML_THREADS */
+
+/**
+ * @Internal: Reading a document never writes to it, so any number of
+ * threads may read one at once. With CYAML_THREADS the only state the
+ * readers share otherwise, the logging stack, is kept per thread, and
+ * the perfect hashes of 'cyaml_freeze' are published with a release
+ * store, so that a document can even be frozen under its readers.
+ */
+#ifdef CYAML_THREADS
+#define CYAML_THREAD_LOCAL __thread
+#define CYAML_LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define CYAML_STORE_RELEASE(x, value) __atomic_store_n(&(x), (value), __ATOMIC_RELEASE)
+#define CYAML_ADD_RELEASE(x, value) __atomic_add_fetch(&(x), (value), __ATOMIC_RELEASE)
+#else /* !defined(CYAML_THREADS) */
+#define CYAML_THREAD_LOCAL
+#define CYAML_LOAD_ACQUIRE(x) (x)
+#define CYAML_STORE_RELEASE(x, value) ((x) = (value))
+#define CYAML_ADD_RELEASE(x, value) ((x) += (value))
+#endif /* CYAML_THREADS */
+
 /**
  * @Internal: The logging stack, used to store messages in a cyclical
  * way such that we can store many messages, but old ones that have
  * not been checked are overwritten with newer error messages.
  */
-static char cyaml_log_stack[CYAML_LOG_STACK_CAPACITY][CYAML_LOG_MESSAGE_CAPACITY];
-static size_t cyaml_log_stack_ptr;
-static size_t cyaml_log_stack_size;
+static CYAML_THREAD_LOCAL char cyaml_log_stack[CYAML_LOG_STACK_CAPACITY][CYAML_LOG_MESSAGE_CAPACITY];
+static CYAML_THREAD_LOCAL size_t cyaml_log_stack_ptr;
+static CYAML_THREAD_LOCAL size_t cyaml_log_stack_size;
 
 #define CYAML_LOG_MESSAGE(fmt, ...)				\
 	cyaml_log_message("%s: " fmt __VA_OPT__(,) __VA_ARGS__)
@@ -129,9 +715,8 @@ cyaml_error_pop(void)
 {
 	if (!cyaml_log_stack_empty()) {
 		cyaml_log_stack_size--;
-		cyaml_log_stack_ptr--;
-		if (cyaml_log_stack_ptr < 0)
-			cyaml_log_stack_ptr += CYAML_LOG_STACK_CAPACITY;
+		cyaml_log_stack_ptr = (cyaml_log_stack_ptr + CYAML_LOG_STACK_CAPACITY - 1)
+			% CYAML_LOG_STACK_CAPACITY;
 		return (const char *) cyaml_log_stack[cyaml_log_stack_ptr];
 	}
 	return "No error.";
@@ -140,33 +725,21 @@ cyaml_error_pop(void)
 
 // need to tokenize the input before hand, makes parsing it far easier.
 typedef struct cyaml_token_t {
-	enum cyaml_token_type {
-		CYAML_TOKEN_EMPTY,
-		CYAML_TOKEN_COLON,
-		CYAML_TOKEN_STRING,
-		CYAML_TOKEN_SYMBOL,
-		CYAML_TOKEN_INDENT,
-		CYAML_TOKEN_UNDENT,
-		CYAML_TOKEN_DASH,
-		CYAML_TOKEN_END,
-		CYAML_TOKEN_ERROR,
-	} type;
+	enum cyaml_token_type type;
 	size_t len;
 	char *data;
 } cyaml_token_t;
 
-static size_t peeked;
-static cyaml_token_t peek_token;
-
 #define CYAML_TOKEN_CREATE(type, len, data) ((cyaml_token_t) { type, len, data })
-#define CYAML_EMPTY_CREATE() (CYAML_TOKEN_CREATE(CYAML_TOKEN_EMPTY, 0, NULL))
-#define CYAML_COLON_CREATE() (CYAML_TOKEN_CREATE(CYAML_TOKEN_COLON, 0, NULL))
+/* 'data' of any token but an error is where it is in the document */
+#define CYAML_EMPTY_CREATE(len, data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_EMPTY, len, data))
+#define CYAML_COLON_CREATE(data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_COLON, 0, data))
 #define CYAML_STRING_CREATE(len, data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_STRING, len, data))
 #define CYAML_SYMBOL_CREATE(len, data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_SYMBOL, len, data))
-#define CYAML_INDENT_CREATE(len) (CYAML_TOKEN_CREATE(CYAML_TOKEN_INDENT, len, NULL))
-#define CYAML_UNDENT_CREATE(len) (CYAML_TOKEN_CREATE(CYAML_TOKEN_UNDENT, len, NULL))
-#define CYAML_DASH_CREATE() (CYAML_TOKEN_CREATE(CYAML_TOKEN_DASH, 0, NULL))
-#define CYAML_END_CREATE() (CYAML_TOKEN_CREATE(CYAML_TOKEN_END, 0, NULL))
+#define CYAML_INDENT_CREATE(len, data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_INDENT, len, data))
+#define CYAML_UNDENT_CREATE(len, data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_UNDENT, len, data))
+#define CYAML_DASH_CREATE(data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_DASH, 0, data))
+#define CYAML_END_CREATE(data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_END, 0, data))
 #define CYAML_ERROR_CREATE(len, data) (CYAML_TOKEN_CREATE(CYAML_TOKEN_ERROR, len, data))
 #define CYAML_TOKEN_STRINGP(token) (token.type == CYAML_TOKEN_STRING)
 #define CYAML_TOKEN_KEYP(token)    (token.type == CYAML_TOKEN_SYMBOL)
@@ -175,58 +748,130 @@ static cyaml_token_t peek_token;
 #define CYAML_TOKEN_INDENTP(token) (token.type == CYAML_TOKEN_INDENT)
 #define CYAML_TOKEN_UNDENTP(token) (token.type == CYAML_TOKEN_UNDENT)
 #define CYAML_TOKEN_SPACEP(token) (token.type == CYAML_TOKEN_INDENT || token.type == CYAML_TOKEN_UNDENT)
+#define CYAML_TOKEN_LINEP(token)   (token.type == CYAML_TOKEN_EMPTY || CYAML_TOKEN_SPACEP(token))
 #define CYAML_TOKEN_DASHP(token)   (token.type == CYAML_TOKEN_DASH)
+#define CYAML_TOKEN_ENDP(token)    (token.type == CYAML_TOKEN_END)
+#define CYAML_TOKEN_ERRORP(token)  (token.type == CYAML_TOKEN_ERROR)
+
+/**
+ * @Internal: State of the tokenizer between two calls; 'line_start' is
+ * set whenever the next token begins a new line (or follows a dash), in
+ * which case its indentation is reported before anything else.
+ *
+ * Tokens are read from 'cursor' up to CYAML_TOKEN_RING at a time into
+ * 'ring', whose 'count' tokens from 'head' on have not been taken yet,
+ * so looking ahead is reading the ring. They are kept there in the
+ * form 'cyaml_tokenize_packed' reports them in, relative to 'base'. Reading
+ * stops early at the end of the document or an error, which 'cursor'
+ * is then left in front of, with its message in 'error'.
+ *
+ * 'indents' holds the columns of the open indentation levels, the first
+ * one being column 0. A line indented past the innermost level opens a
+ * level with an INDENT, and a line indented less closes every level
+ * past its column with an UNDENT each, so the parser knows exactly how
+ * many blocks end there. The stack starts out in 'indents_fixed' and
+ * grows on 'arena'; without an arena it cannot grow.
+ */
+typedef struct cyaml_lexer_t {
+	char *base;
+	char *cursor;
+	size_t head;
+	size_t count;
+	int stopped;
+	char *error;
+	size_t line_start;
+	char *line_begin;
+	size_t *indents;
+	size_t depth;
+	size_t capacity;
+	struct cyaml_arena_t *arena;
+	size_t indents_fixed[CYAML_INDENT_STACK];
+	cyaml_packed_t ring[CYAML_TOKEN_RING];
+	cyaml_lexeme_t wide[CYAML_TOKEN_RING];
+} cyaml_lexer_t;
 
-static size_t indent_level;
+static void *
+cyaml_stack_grow(struct cyaml_arena_t *arena, void *items, size_t *capacity, size_t size,
+		 void *fixed);
+
+static void
+cyaml_lexer_init(cyaml_lexer_t *lexer, char *buffer, struct cyaml_arena_t *arena)
+{
+	memset(lexer, 0, offsetof(cyaml_lexer_t, indents_fixed));
+	lexer->base = buffer;
+	lexer->cursor = buffer;
+	lexer->line_start = 1;
+	lexer->line_begin = buffer;
+	lexer->indents = lexer->indents_fixed;
+	lexer->indents[0] = 0;
+	lexer->depth = 1;
+	lexer->capacity = CYAML_INDENT_STACK;
+	lexer->arena = arena;
+}
 
 static cyaml_token_t
-cyaml_token_get(char **buffer)
+cyaml_token_scan(cyaml_lexer_t *lexer, char **buffer)
 {
-	cyaml_token_t token;
 	char *p = *buffer, *q;
-	if (peeked) {
-		peeked = 0;
-		return peek_token;
-	}
-	
-	if (*p == '\n') {
-		p = p + strspn(p, "\n");
-	}
-
-	if (*p == '\0') {
-		return CYAML_END_CREATE();
-	}
-	
-	if (isspace(*p)) {
-		q = p + strspn(p, " \t");
-		size_t current_indent_level = (size_t) (q-p);
-		if (current_indent_level == indent_level) {
-			token = CYAML_EMPTY_CREATE();
-		} else if (current_indent_level > indent_level) {
-			token = CYAML_INDENT_CREATE(current_indent_level);
-		} else {
-			token = CYAML_UNDENT_CREATE(current_indent_level);
+	for (q = p; *q == ' ' || *q == '\t'; q++);
+	while (*q == '\n') {
+		p = q + 1;
+		for (q = p; *q == ' ' || *q == '\t'; q++);
+		lexer->line_begin = p;
+		lexer->line_start = 1;
+	}
+
+	if (*q == '\0') {
+		/* the end of the document closes every level that is open */
+		if (lexer->depth > 1) {
+			lexer->depth--;
+			return CYAML_UNDENT_CREATE(lexer->indents[lexer->depth - 1], *buffer);
 		}
-		indent_level = current_indent_level;
+		return CYAML_END_CREATE(*buffer);
+	}
+
+	if (lexer->line_start) {
+		size_t column = (size_t) (q - lexer->line_begin);
+		size_t *indents;
 		*buffer = q;
-		return token;
-	} else if (isalpha(*p)) {
-		q = p + strcspn(p, " \t\n\":-");
-		if (*q == '"') {
-			char *error = "Invalid symbol!";
-			return CYAML_ERROR_CREATE(strlen(error), error);
+		if (column < lexer->indents[lexer->depth - 1]) {
+			/* the line is looked at again until it is back at an open
+			 * level, or past one, which it then opens */
+			lexer->depth--;
+			return CYAML_UNDENT_CREATE(lexer->indents[lexer->depth - 1], q);
 		}
-		*buffer = q;
-		return CYAML_SYMBOL_CREATE((size_t)(q-p), p);
-	} else if (*p == '"') {
-		p++;
-		q = p;
-		while (*q != '"' && *q != '\0') {
-			q += strcspn(q, "\"");
-			if (*q == '\0') break;
-			if (q[-1] == '\\') {
-				q++;
+
+		if (column == lexer->indents[lexer->depth - 1]) {
+			lexer->line_start = 0;
+			return CYAML_EMPTY_CREATE(column, q);
+		}
+
+		if (lexer->depth == lexer->capacity) {
+			indents = lexer->arena ? cyaml_stack_grow(lexer->arena, lexer->indents, &lexer->capacity,
+								  sizeof(*indents), lexer->indents_fixed) : NULL;
+			if (!indents) {
+				/* the arena has reported why it could not grow */
+				char *error = lexer->arena ? "" : "Document is nested too deeply!";
+				return CYAML_ERROR_CREATE(strlen(error), error);
 			}
+			lexer->indents = indents;
+		}
+		lexer->indents[lexer->depth++] = column;
+		lexer->line_start = 0;
+		return CYAML_INDENT_CREATE(column, q);
+	}
+
+	p = q;
+	if (*p == '"') {
+		p++;
+		q = p + strcspn(p, "\"\\");
+		while (*q == '\\' && q[1] != '\0') {
+			q += 2;
+			q += strcspn(q, "\"\\");
+		}
+
+		if (*q == '\\') {
+			q++;
 		}
 
 		if (*q == '\0') {
@@ -236,150 +881,6945 @@ cyaml_token_get(char **buffer)
 
 		*buffer = q + 1;
 		return CYAML_STRING_CREATE((size_t)(q-p), p);
-	} else if (*p == '-') {
-		p++;
-		*buffer = p;
-		return CYAML_DASH_CREATE();
+	} else if (*p == '-' && (p[1] == ' ' || p[1] == '\t' || p[1] == '\n' || p[1] == '\0')) {
+		/* the content of a list item is indented past its dash */
+		lexer->line_start = 1;
+		*buffer = p + 1;
+		return CYAML_DASH_CREATE(p);
 	} else if (*p == ':') {
-		p++;
-		*buffer = p;
-		return CYAML_COLON_CREATE();
+		*buffer = p + 1;
+		return CYAML_COLON_CREATE(p);
+	} else if (isgraph((unsigned char) *p)) {
+		q = p;
+		for (;;) {
+			q += strcspn(q, "\n\":");
+			if (*q != ':' || q[1] == ' ' || q[1] == '\t'
+			    || q[1] == '\n' || q[1] == '\0')
+				break;
+			q++;
+		}
+
+		if (*q == '"') {
+			char *error = "Invalid symbol!";
+			return CYAML_ERROR_CREATE(strlen(error), error);
+		}
+
+		while (q[-1] == ' ' || q[-1] == '\t') {
+			q--;
+		}
+		*buffer = q;
+		return CYAML_SYMBOL_CREATE((size_t)(q-p), p);
 	}
-	
+
 	char *error = "Unrecognized token!";
 	return CYAML_ERROR_CREATE(strlen(error), error);
 }
 
-static cyaml_token_t
-cyaml_token_peek(char **buffer)
+/**
+ * @Internal: Reads the next token into 'lexeme', stopping the lexer at
+ * the end of the document or an error.
+ */
+static inline void
+cyaml_lexer_next(cyaml_lexer_t *lexer, cyaml_lexeme_t *lexeme)
 {
-	char *p = *buffer;
-	peek_token = cyaml_token_get(&p);
-	peeked = 1;
-	return peek_token;
+	cyaml_token_t token;
+	char *start = lexer->cursor, *error = "Token is longer than 4 GB!";
+	token = cyaml_token_scan(lexer, &lexer->cursor);
+	if (!CYAML_TOKEN_ERRORP(token) && token.len > UINT32_MAX) {
+		lexer->cursor = start;
+		token = CYAML_ERROR_CREATE(strlen(error), error);
+	}
+
+	lexeme->type = token.type;
+	if (CYAML_TOKEN_ERRORP(token)) {
+		lexer->error = token.data;
+		lexeme->len = 0;
+		lexeme->offset = (uint64_t) (lexer->cursor - lexer->base);
+	} else {
+		lexeme->len = (uint32_t) token.len;
+		lexeme->offset = (uint64_t) (token.data - lexer->base);
+	}
+	lexer->stopped = CYAML_TOKEN_ENDP(token) || CYAML_TOKEN_ERRORP(token);
 }
 
-static inline char *
-cyaml_read_file(char *s, size_t n)
+/**
+ * @Internal: Reads up to 'cap' tokens into 'tokens', stopping after the
+ * end of the document or an error. Returns how many it read.
+ */
+static size_t
+cyaml_lexer_scan(cyaml_lexer_t *lexer, cyaml_lexeme_t *tokens, size_t cap)
 {
-	FILE *fd;
-	size_t fsize, nread;
-	char fname[n+1], *buffer;
-	snprintf(fname, n + 1, "%.*s", n, s);
-	fname[n] = '\0';
-	fd = fopen(fname, "r");
-	if (!fd) {
-		cyaml_log_message("Failed to open file!");
-		return NULL;
+	size_t i;
+	for (i = 0; i < cap && !lexer->stopped; i++) {
+		cyaml_lexer_next(lexer, &tokens[i]);
 	}
+	return i;
+}
 
-	fseek(fd, 0, SEEK_END);
-	fsize = ftell(fd);
-	fseek(fd, 0, SEEK_SET);
+/**
+ * @Internal: Packs 'lexeme' into 'packed', unless its offset or length
+ * does not fit.
+ */
+static inline int
+cyaml_lexer_pack(cyaml_lexeme_t *lexeme, cyaml_packed_t *packed)
+{
+	if (lexeme->offset > UINT32_MAX || lexeme->len >= CYAML_PACKED_WIDE) {
+		return 0;
+	}
+	packed->offset = (uint32_t) lexeme->offset;
+	packed->info = lexeme->type | lexeme->len << 8;
+	return 1;
+}
 
-	if (fsize <= 0) {
-		fclose(fd);
-		cyaml_log_message("File was empty!");
-		return NULL;
+/**
+ * @Internal: Reads tokens into the ring until it is full, or up to the
+ * end of the document or an error. Once there, the token it stopped at
+ * (still in the ring, even if taken) is the only one that follows.
+ *
+ * The ring holds packed tokens, the few that do not fit (past 4 GB into
+ * the document or 16 MB long) are marked with a length of
+ * CYAML_PACKED_WIDE and kept whole in the same slot of 'wide'.
+ */
+static void
+cyaml_lexer_fill(cyaml_lexer_t *lexer)
+{
+	cyaml_lexeme_t lexeme;
+	size_t slot, last;
+	if (lexer->stopped) {
+		slot = (lexer->head + lexer->count) & (CYAML_TOKEN_RING - 1);
+		last = (lexer->head + lexer->count - 1) & (CYAML_TOKEN_RING - 1);
+		lexer->ring[slot] = lexer->ring[last];
+		lexer->wide[slot] = lexer->wide[last];
+		lexer->count++;
+		return;
 	}
 
-	buffer = malloc(fsize + 1);
-	if (!buffer) {
-		fclose(fd);
-		cyaml_log_message("Ran out of memory!");
+	while (lexer->count < CYAML_TOKEN_RING && !lexer->stopped) {
+		slot = (lexer->head + lexer->count++) & (CYAML_TOKEN_RING - 1);
+		cyaml_lexer_next(lexer, &lexeme);
+		if (!cyaml_lexer_pack(&lexeme, &lexer->ring[slot])) {
+			lexer->ring[slot].info = lexeme.type | (uint32_t) CYAML_PACKED_WIDE << 8;
+			lexer->wide[slot] = lexeme;
+		}
+	}
+}
+
+static inline cyaml_token_t
+cyaml_lexer_token(cyaml_lexer_t *lexer, size_t slot)
+{
+	cyaml_packed_t packed = lexer->ring[slot];
+	if (CYAML_PACKED_TYPE(packed) == CYAML_TOKEN_ERROR) {
+		return CYAML_ERROR_CREATE(strlen(lexer->error), lexer->error);
+	}
+
+	if (CYAML_PACKED_LEN(packed) == CYAML_PACKED_WIDE) {
+		return CYAML_TOKEN_CREATE(CYAML_PACKED_TYPE(packed), lexer->wide[slot].len,
+					  lexer->base + lexer->wide[slot].offset);
+	}
+	return CYAML_TOKEN_CREATE(CYAML_PACKED_TYPE(packed), CYAML_PACKED_LEN(packed),
+				  lexer->base + packed.offset);
+}
+
+static inline cyaml_token_t
+cyaml_token_get(cyaml_lexer_t *lexer)
+{
+	size_t slot;
+	if (lexer->count == 0) {
+		cyaml_lexer_fill(lexer);
+	}
+
+	slot = lexer->head;
+	lexer->head = (lexer->head + 1) & (CYAML_TOKEN_RING - 1);
+	lexer->count--;
+	return cyaml_lexer_token(lexer, slot);
+}
+
+/**
+ * @Internal: Returns the token 'ahead' tokens after the next one without
+ * taking it, 'ahead' being less than CYAML_TOKEN_RING. Past the end of
+ * the document or an error, that token is returned again.
+ */
+static inline cyaml_token_t
+cyaml_token_peek(cyaml_lexer_t *lexer, size_t ahead)
+{
+	if (lexer->count <= ahead) {
+		cyaml_lexer_fill(lexer);
+		if (lexer->count <= ahead) {
+			ahead = lexer->count - 1;
+		}
+	}
+	return cyaml_lexer_token(lexer, (lexer->head + ahead) & (CYAML_TOKEN_RING - 1));
+}
+
+/**
+ * @Internal: Where the memory of a document comes from. Documents
+ * parsed into a caller's buffer bump-allocate from its start, while
+ * temporary allocations (the copy of the input, scratch space) are
+ * taken from its end and given back in reverse order. Without a buffer
+ * the document bump-allocates from a list of chunks taken from
+ * CYAML_MALLOC, so that freeing it only has to give back the chunks,
+ * and temporary allocations come from CYAML_MALLOC directly.
+ */
+typedef struct cyaml_chunk_t {
+	struct cyaml_chunk_t *next;
+	size_t size;
+	size_t mapped; /* length of the mapping, 0 for CYAML_MALLOC */
+	enum cyaml_pages pages;
+	int node;
+} cyaml_chunk_t;
+
+typedef struct cyaml_arena_t {
+	char *base;
+	size_t size;
+	size_t used;
+	size_t top;
+	size_t peak;
+	size_t needed;
+	cyaml_chunk_t *chunks;
+	enum cyaml_pages pages;
+	int node;
+} cyaml_arena_t;
+
+/**
+ * @Internal: A document, the root returned to the caller is embedded
+ * so that 'cyaml_free' can find the memory the document came from.
+ */
+typedef struct cyaml_doc_t {
+	cyaml_arena_t arena;
+	int shared; /* parsed with 'options.share' */
+	uint64_t stamp; /* set when the document is made, see 'CYAML_STAMP' */
+	cyaml_t root;
+} cyaml_doc_t;
+
+#define CYAML_DOC(cyaml) ((cyaml_doc_t *) ((char *) (cyaml) - offsetof(cyaml_doc_t, root)))
+
+/**
+ * @Internal: Every document made gets a stamp of its own, the next
+ * value of the process-wide 'cyaml_generation'. What 'cyaml_lookup'
+ * remembers is only good for the document with the stamp it was looked
+ * up in, as memory of a freed document may hold the next one, while
+ * parsing or freeing other documents leaves it alone.
+ */
+#if CYAML_LOOKUP_CACHE
+static uint64_t cyaml_generation;
+#define CYAML_STAMP(doc) ((doc)->stamp = CYAML_ADD_RELEASE(cyaml_generation, 1))
+#else /* !CYAML_LOOKUP_CACHE */
+#define CYAML_STAMP(doc) ((doc)->stamp = 0)
+#endif /* CYAML_LOOKUP_CACHE */
+#define CYAML_ALIGN_UP(size) (((size) + CYAML_ALIGN - 1) & ~(size_t) (CYAML_ALIGN - 1))
+#define CYAML_ARENA_FIXEDP(arena) ((arena)->base && !(arena)->chunks)
+#define CYAML_CHUNK_HEADER CYAML_ALIGN_UP(sizeof(cyaml_chunk_t))
+
+static void
+cyaml_arena_init(cyaml_arena_t *arena, void *buffer, size_t size)
+{
+	size_t padding;
+	memset(arena, 0, sizeof(*arena));
+	arena->node = -1;
+	if (buffer) {
+		padding = CYAML_ALIGN_UP((uintptr_t) buffer) - (uintptr_t) buffer;
+		arena->base = (char *) buffer + padding;
+		arena->size = size > padding ? (size - padding) & ~(size_t) (CYAML_ALIGN - 1) : 0;
+	}
+}
+
+#ifdef CYAML_THREADS
+static pthread_mutex_t cyaml_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CYAML_CHUNK_LOCK() pthread_mutex_lock(&cyaml_chunk_lock)
+#define CYAML_CHUNK_UNLOCK() pthread_mutex_unlock(&cyaml_chunk_lock)
+#else /* !defined(CYAML_THREADS) */
+#define CYAML_CHUNK_LOCK() ((void) 0)
+#define CYAML_CHUNK_UNLOCK() ((void) 0)
+#endif /* CYAML_THREADS */
+
+/**
+ * @Internal: Chunks kept by 'cyaml_recycle' for the next parse, which
+ * takes them instead of asking CYAML_MALLOC for fresh ones.
+ */
+static cyaml_chunk_t *cyaml_retained;
+static size_t cyaml_retained_size;
+
+static void
+cyaml_chunks_free(cyaml_chunk_t *chunk)
+{
+	cyaml_chunk_t *next;
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+#ifdef CYAML_HAVE_MMAP
+		if (chunk->mapped) {
+			munmap(chunk, chunk->mapped);
+			continue;
+		}
+#endif /* CYAML_HAVE_MMAP */
+		CYAML_FREE(chunk);
+	}
+}
+
+#ifdef CYAML_THREADS
+/**
+ * @Internal: The reclaimer thread frees the chunk lists that are queued
+ * by 'cyaml_free', so that the thread dropping a document does not pay
+ * for unmapping its memory. When the queue is full the chunks are
+ * freed right away instead of waiting for room.
+ */
+static pthread_t cyaml_reclaim_thread;
+static pthread_cond_t cyaml_reclaim_cond = PTHREAD_COND_INITIALIZER;
+static cyaml_chunk_t *cyaml_reclaim_queue[CYAML_RECLAIM_QUEUE];
+static size_t cyaml_reclaim_head;
+static size_t cyaml_reclaim_size;
+static int cyaml_reclaim_running;
+
+static void *
+cyaml_reclaim_main(void *data)
+{
+	cyaml_chunk_t *chunks;
+#ifdef SCHED_IDLE
+	struct sched_param param = { 0 };
+	/* freeing is never urgent, so stay out of the way of the threads
+	 * sharing the cpu */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif /* SCHED_IDLE */
+	(void) data;
+	CYAML_CHUNK_LOCK();
+	for (;;) {
+		while (!cyaml_reclaim_size && cyaml_reclaim_running) {
+			pthread_cond_wait(&cyaml_reclaim_cond, &cyaml_chunk_lock);
+		}
+
+		/* the queue is drained before stopping */
+		if (!cyaml_reclaim_size) {
+			break;
+		}
+
+		chunks = cyaml_reclaim_queue[cyaml_reclaim_head];
+		cyaml_reclaim_head = (cyaml_reclaim_head + 1) % CYAML_RECLAIM_QUEUE;
+		cyaml_reclaim_size--;
+		CYAML_CHUNK_UNLOCK();
+		cyaml_chunks_free(chunks);
+		CYAML_CHUNK_LOCK();
+	}
+	CYAML_CHUNK_UNLOCK();
+	return NULL;
+}
+
+static int
+cyaml_reclaim_push(cyaml_chunk_t *chunks)
+{
+	int queued = 0;
+	CYAML_CHUNK_LOCK();
+	if (cyaml_reclaim_running && cyaml_reclaim_size < CYAML_RECLAIM_QUEUE) {
+		cyaml_reclaim_queue[(cyaml_reclaim_head + cyaml_reclaim_size) % CYAML_RECLAIM_QUEUE]
+			= chunks;
+		cyaml_reclaim_size++;
+		pthread_cond_signal(&cyaml_reclaim_cond);
+		queued = 1;
+	}
+	CYAML_CHUNK_UNLOCK();
+	return queued;
+}
+
+CYAMLDEF int
+cyaml_reclaimer_start(void)
+{
+	int started = 1;
+	CYAML_CHUNK_LOCK();
+	if (!cyaml_reclaim_running) {
+		started = pthread_create(&cyaml_reclaim_thread, NULL, cyaml_reclaim_main, NULL) == 0;
+		cyaml_reclaim_running = started;
+	}
+	CYAML_CHUNK_UNLOCK();
+
+	if (!started) {
+		cyaml_log_message("Failed to start the reclaimer!");
+	}
+	return started;
+}
+
+CYAMLDEF void
+cyaml_reclaimer_stop(void)
+{
+	int running;
+	CYAML_CHUNK_LOCK();
+	running = cyaml_reclaim_running;
+	cyaml_reclaim_running = 0;
+	pthread_cond_signal(&cyaml_reclaim_cond);
+	CYAML_CHUNK_UNLOCK();
+
+	if (running) {
+		pthread_join(cyaml_reclaim_thread, NULL);
+	}
+}
+#endif /* CYAML_THREADS */
+
+/**
+ * @Internal: Gets rid of a list of chunks, through the reclaimer if it
+ * is running.
+ */
+static void
+cyaml_chunks_drop(cyaml_chunk_t *chunks)
+{
+#ifdef CYAML_THREADS
+	if (chunks && cyaml_reclaim_push(chunks)) {
+		return;
+	}
+#endif /* CYAML_THREADS */
+	cyaml_chunks_free(chunks);
+}
+
+/**
+ * @Internal: Gives back every chunk of the arena at once, no matter
+ * how many nodes were allocated from them.
+ */
+static void
+cyaml_arena_release(cyaml_arena_t *arena)
+{
+	if (CYAML_ARENA_FIXEDP(arena)) {
+		return;
+	}
+
+	cyaml_chunks_drop(arena->chunks);
+	arena->chunks = NULL;
+	arena->base = NULL;
+	arena->size = arena->used = 0;
+}
+
+#ifdef CYAML_HAVE_MMAP
+/**
+ * @Internal: Maps a chunk of at least 'size' bytes straight from the
+ * kernel, backed by huge pages if 'pages' asks for them and bound to
+ * the NUMA node 'node' unless it is negative. Huge pages are only used
+ * for mappings aligned to CYAML_HUGE_PAGE_SIZE, so the mapping is made
+ * larger by a page and trimmed to the aligned part.
+ */
+static cyaml_chunk_t *
+cyaml_chunk_map(size_t size, enum cyaml_pages pages, int node)
+{
+	unsigned long mask[CYAML_NUMA_NODES / (CHAR_BIT * sizeof(unsigned long))] = { 0 };
+	cyaml_chunk_t *chunk;
+	char *data = MAP_FAILED;
+	size_t page, length, head;
+	page = pages != CYAML_PAGES_DEFAULT ? CYAML_HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+	if (size > SIZE_MAX - CYAML_CHUNK_HEADER - 2 * page) {
+		cyaml_log_message("Ran out of memory!");
 		return NULL;
 	}
+	size = (CYAML_CHUNK_HEADER + size + page - 1) & ~(page - 1);
 
-	nread = fread(buffer, sizeof(*buffer), fsize, fd);
-	if (nread != fsize) {
-		free(buffer);
-		fclose(fd);
-		cyaml_log_message("Failed to read file!");
+#ifdef MAP_HUGETLB
+	if (pages == CYAML_PAGES_HUGETLB) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif /* MAP_HUGETLB */
+
+	/* without reserved huge pages fall back to transparent ones */
+	if (data == MAP_FAILED) {
+		length = pages != CYAML_PAGES_DEFAULT ? size + page : size;
+		data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED) {
+			cyaml_log_message("Ran out of memory!");
+			return NULL;
+		}
+
+		if (length > size) {
+			head = ((uintptr_t) data + page - 1) / page * page - (uintptr_t) data;
+			if (head) {
+				munmap(data, head);
+			}
+			if (length - head > size) {
+				munmap(data + head + size, length - head - size);
+			}
+			data += head;
+#ifdef MADV_HUGEPAGE
+			madvise(data, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+		}
+	}
+
+	if (node >= 0) {
+		if ((size_t) node >= CYAML_NUMA_NODES) {
+			munmap(data, size);
+			cyaml_log_message("No NUMA node %d!", node);
+			return NULL;
+		}
+
+		mask[node / (CHAR_BIT * sizeof(*mask))] = 1UL << (node % (CHAR_BIT * sizeof(*mask)));
+		if (syscall(SYS_mbind, data, size, CYAML_MPOL_BIND, mask,
+			    (unsigned long) CYAML_NUMA_NODES + 1, 0) != 0) {
+			munmap(data, size);
+			cyaml_log_message("Failed to bind memory to NUMA node %d!", node);
+			return NULL;
+		}
+	}
+
+	chunk = (cyaml_chunk_t *) data;
+	chunk->size = size - CYAML_CHUNK_HEADER;
+	chunk->mapped = size;
+	return chunk;
+}
+#endif /* CYAML_HAVE_MMAP */
+
+/**
+ * @Internal: Returns a chunk of at least 'size' bytes for 'arena',
+ * preferring a retained one of the same kind that is not more than
+ * four times too large.
+ */
+static cyaml_chunk_t *
+cyaml_chunk_create(cyaml_arena_t *arena, size_t size)
+{
+	cyaml_chunk_t *chunk = NULL, **link;
+	CYAML_CHUNK_LOCK();
+	for (link = &cyaml_retained; *link; link = &(*link)->next) {
+		if ((*link)->size >= size && (*link)->size / 4 <= size
+		    && (*link)->pages == arena->pages && (*link)->node == arena->node) {
+			chunk = *link;
+			*link = chunk->next;
+			cyaml_retained_size -= chunk->size;
+			break;
+		}
+	}
+	CYAML_CHUNK_UNLOCK();
+
+	if (chunk) {
+		return chunk;
+	}
+
+#ifdef CYAML_HAVE_MMAP
+	if (arena->pages != CYAML_PAGES_DEFAULT || arena->node >= 0) {
+		chunk = cyaml_chunk_map(size, arena->pages, arena->node);
+	} else
+#endif /* CYAML_HAVE_MMAP */
+	{
+		if (size > SIZE_MAX - CYAML_CHUNK_HEADER) {
+			cyaml_log_message("Ran out of memory!");
+			return NULL;
+		}
+
+		chunk = CYAML_MALLOC(CYAML_CHUNK_HEADER + size);
+		if (!chunk) {
+			cyaml_log_message("Ran out of memory!");
+			return NULL;
+		}
+		chunk->size = size;
+		chunk->mapped = 0;
+	}
+
+	if (chunk) {
+		chunk->pages = arena->pages;
+		chunk->node = arena->node;
+	}
+	return chunk;
+}
+
+/**
+ * @Internal: Makes room for an allocation of 'size' bytes in an arena
+ * without a buffer. Chunks double in size up to CYAML_CHUNK_MAX, an
+ * allocation larger than a quarter of that gets a chunk of its own
+ * which is linked in behind the current one, so the rest of the
+ * current chunk is not wasted. Returns the memory of such an
+ * allocation, 'arena->base' otherwise.
+ */
+static void *
+cyaml_arena_grow(cyaml_arena_t *arena, size_t size)
+{
+	cyaml_chunk_t *chunk;
+	size_t chunk_size;
+	if (size > CYAML_CHUNK_MAX / 4) {
+		chunk = cyaml_chunk_create(arena, size);
+		if (!chunk) {
+			return NULL;
+		}
+
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+		return (char *) chunk + CYAML_CHUNK_HEADER;
+	}
+
+	chunk_size = arena->size ? arena->size * 2 : CYAML_CHUNK_SIZE;
+	chunk_size = chunk_size < CYAML_CHUNK_MAX ? chunk_size : CYAML_CHUNK_MAX;
+	while (chunk_size < size) {
+		/* an allocation larger than the next chunk skips ahead */
+		chunk_size *= 2;
+	}
+	chunk = cyaml_chunk_create(arena, chunk_size);
+	if (!chunk) {
 		return NULL;
 	}
 
-	buffer[nread] = '\0';
-	fclose(fd);
-	return buffer;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->base = (char *) chunk + CYAML_CHUNK_HEADER;
+	arena->size = chunk->size;
+	arena->used = 0;
+	return arena->base;
 }
 
-static cyaml_t *
-cyaml_create(void)
+static int
+cyaml_arena_fits(cyaml_arena_t *arena, size_t size)
 {
-	cyaml_t *storage;
-	storage = malloc(sizeof(*storage));
-	if (!storage) {
-		cyaml_log_message("Ran out of memory!");
+	if (size > arena->size - arena->used - arena->top) {
+		arena->needed = arena->used + arena->top + size - arena->size;
+		cyaml_log_message("Buffer needs at least %zu more bytes!", arena->needed);
+		return 0;
+	}
+
+	if (arena->used + arena->top + size > arena->peak) {
+		arena->peak = arena->used + arena->top + size;
+	}
+	return 1;
+}
+
+static void *
+cyaml_arena_alloc(cyaml_arena_t *arena, size_t size)
+{
+	void *data;
+	size = CYAML_ALIGN_UP(size);
+	if (!CYAML_ARENA_FIXEDP(arena) && size > arena->size - arena->used) {
+		data = cyaml_arena_grow(arena, size);
+		if (!data || data != arena->base) {
+			return data;
+		}
+	}
+
+	if (!cyaml_arena_fits(arena, size)) {
 		return NULL;
 	}
+	data = arena->base + arena->used;
+	arena->used += size;
+	return data;
 }
 
-CYAMLDEF cyaml_t *
-cyaml_parse(char *s, size_t n, cyaml_loc_t loc)
+static void *
+cyaml_arena_calloc(cyaml_arena_t *arena, size_t size)
 {
-	cyaml_t *storage;
-	char *buffer, *p;
-	cyaml_token_t token, ptoken;
-	char spaces[1024];
-	if (s == NULL || n <= 0) {
+	void *data;
+	data = cyaml_arena_alloc(arena, size);
+	if (data) {
+		memset(data, 0, size);
+	}
+	return data;
+}
+
+/**
+ * @Internal: Grows 'data' from 'size' to 'new_size' bytes, in place if
+ * it is the last allocation of the arena and there is room left.
+ */
+static void *
+cyaml_arena_realloc(cyaml_arena_t *arena, void *data, size_t size, size_t new_size)
+{
+	void *new_data;
+	size = CYAML_ALIGN_UP(size);
+	new_size = CYAML_ALIGN_UP(new_size);
+	if (data && (char *) data + size == arena->base + arena->used
+	    && (CYAML_ARENA_FIXEDP(arena) || new_size - size <= arena->size - arena->used)) {
+		if (!cyaml_arena_fits(arena, new_size - size)) {
+			return NULL;
+		}
+		arena->used += new_size - size;
+		return data;
+	}
+
+	new_data = cyaml_arena_alloc(arena, new_size);
+	if (new_data && data) {
+		memcpy(new_data, data, size);
+	}
+	return new_data;
+}
+
+/**
+ * @Internal: Frees 'data', which the arena only takes back if it is its
+ * last allocation.
+ */
+static void
+cyaml_arena_free(cyaml_arena_t *arena, void *data, size_t size)
+{
+	if (data && (char *) data + CYAML_ALIGN_UP(size) == arena->base + arena->used) {
+		arena->used -= CYAML_ALIGN_UP(size);
+	}
+}
+
+static void *
+cyaml_arena_push(cyaml_arena_t *arena, size_t size)
+{
+	void *data;
+	if (!CYAML_ARENA_FIXEDP(arena)) {
+		data = CYAML_MALLOC(size);
+		if (!data) {
+			cyaml_log_message("Ran out of memory!");
+		}
+		return data;
+	}
+
+	size = CYAML_ALIGN_UP(size);
+	if (!cyaml_arena_fits(arena, size)) {
 		return NULL;
 	}
+	arena->top += size;
+	return arena->base + arena->size - arena->top;
+}
 
-	storage = cyaml_create();
-	if (!storage) {
-		
+static void
+cyaml_arena_pop(cyaml_arena_t *arena, void *data, size_t size)
+{
+	if (!CYAML_ARENA_FIXEDP(arena)) {
+		CYAML_FREE(data);
+	} else if (data && (char *) data == arena->base + arena->size - arena->top) {
+		/* anything popped out of order stays until the parse is over */
+		arena->top -= CYAML_ALIGN_UP(size);
+	}
+}
+
+/**
+ * @Internal: Doubles a stack of 'capacity' elements of 'size' bytes kept
+ * on the top of 'arena', returning the new stack. Like the table of
+ * 'cyaml_share_grow', with a buffer the larger stack is moved down into
+ * the place of the old one. A stack that is still in its 'fixed'
+ * storage outside of the arena is copied, not given back.
+ */
+static void *
+cyaml_stack_grow(cyaml_arena_t *arena, void *items, size_t *capacity, size_t size, void *fixed)
+{
+	char *grown;
+	size_t bytes = *capacity * size;
+	if (*capacity > SIZE_MAX / 2 / size) {
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
 	}
 
-	if (loc == CYAML_LOC_DISK) {
-		buffer = cyaml_read_file(s, n);
-	} else {
-		buffer = strndup(s, n);
-	}
-
-	p = buffer;
-	
-	token = cyaml_token_get(&p);
-	memset(spaces, ' ', sizeof(spaces));
-	while (token.type != CYAML_TOKEN_ERROR && token.type != CYAML_TOKEN_END) {
-		if (CYAML_TOKEN_KEYP(token)) {
-			ptoken = cyaml_token_peek(&p);
-			if (!CYAML_TOKEN_COLONP(ptoken)) {
-			}
-		}
-		
-		if (token.type == CYAML_TOKEN_INDENT) {
-			printf("INDENT: '%.*s'\n", token.len, spaces);
-		} else if (token.type == CYAML_TOKEN_UNDENT) {
-			printf("UNDENT: '%.*s'\n", token.len, spaces);
-		} else if (token.type == CYAML_TOKEN_STRING) {
-			printf("String: \"%.*s\"\n", token.len, token.data);
-		} else if (token.type == CYAML_TOKEN_SYMBOL) {
-			printf("Symbol: '%.*s'\n", token.len, token.data);
-		} else if (token.type == CYAML_TOKEN_DASH) {
-			printf("DASH: '-'\n");
-		} else if (token.type == CYAML_TOKEN_COLON) {
-			printf("COLON: ':'\n");
-		}
-		token = cyaml_token_get(&p);
-	}
-	
-	free(buffer);
-	return NULL;
+	grown = cyaml_arena_push(arena, 2 * bytes);
+	if (!grown) {
+		return NULL;
+	}
+
+	memcpy(grown, items, bytes);
+	if (items != fixed && CYAML_ARENA_FIXEDP(arena)) {
+		cyaml_arena_pop(arena, grown, 2 * bytes);
+		cyaml_arena_pop(arena, items, bytes);
+		grown = memmove(cyaml_arena_push(arena, 2 * bytes), grown, bytes);
+	} else if (items != fixed) {
+		cyaml_arena_pop(arena, items, bytes);
+	}
+	*capacity *= 2;
+	return grown;
 }
 
-CYAMLDEF cyaml_t *
-cyaml_lookup(cyaml_t *cyaml, char *path)
+static void
+cyaml_lexer_free(cyaml_lexer_t *lexer)
 {
-	cyaml_log_message("TODO: Implement 'cyaml_lookup'");
-	return NULL;
+	if (lexer->indents != lexer->indents_fixed) {
+		cyaml_arena_pop(lexer->arena, lexer->indents, lexer->capacity * sizeof(*lexer->indents));
+	}
 }
 
-CYAMLDEF void
-cyaml_free(cyaml_t *cyaml)
+/**
+ * @Internal: A point in the allocations of an arena that it can be
+ * rewound to, dropping everything allocated since.
+ */
+typedef struct cyaml_mark_t {
+	cyaml_chunk_t *chunk;
+	cyaml_chunk_t *next;
+	size_t used;
+} cyaml_mark_t;
+
+static void
+cyaml_arena_mark(cyaml_arena_t *arena, cyaml_mark_t *mark)
 {
-	cyaml_log_message("TODO: Implement 'cyaml_free'");
-	return NULL;
+	mark->chunk = arena->chunks;
+	mark->next = arena->chunks ? arena->chunks->next : NULL;
+	mark->used = arena->used;
+}
+
+/**
+ * @Internal: Rewinds 'arena' to 'mark' unless it took another chunk
+ * since, in which case the allocations are simply left behind.
+ */
+static void
+cyaml_arena_rewind(cyaml_arena_t *arena, cyaml_mark_t *mark)
+{
+	if (arena->chunks == mark->chunk && (!mark->chunk || mark->chunk->next == mark->next)) {
+		arena->used = mark->used;
+	}
+}
+
+/**
+ * @Internal: Checks that 'fname' names a regular file, as directories,
+ * pipes and devices have no size to read up to. Only done on Linux.
+ */
+static int
+cyaml_file_regular(char *fname)
+{
+#ifdef __linux__
+	struct stat st;
+	if (stat(fname, &st) != 0) {
+		cyaml_log_message("Failed to open file!");
+		return 0;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		cyaml_log_message("Not a regular file!");
+		return 0;
+	}
+#else /* !defined(__linux__) */
+	(void) fname;
+#endif /* __linux__ */
+	return 1;
+}
+
+static inline char *
+cyaml_read_file(cyaml_arena_t *arena, char *s, size_t n, size_t *size, size_t max)
+{
+	FILE *fd;
+	size_t fsize, nread;
+	long end;
+	char fname[CYAML_MAX_PATH], *buffer;
+	if (n >= CYAML_MAX_PATH) {
+		cyaml_log_message("Path is longer than %d bytes!", CYAML_MAX_PATH - 1);
+		return NULL;
+	}
+	memcpy(fname, s, n);
+	fname[n] = '\0';
+	if (!cyaml_file_regular(fname)) {
+		return NULL;
+	}
+
+	fd = fopen(fname, "r");
+	if (!fd) {
+		cyaml_log_message("Failed to open file!");
+		return NULL;
+	}
+
+	/* the size is checked against 'max' before anything is allocated */
+	if (fseek(fd, 0, SEEK_END) != 0 || (end = ftell(fd)) < 0 || fseek(fd, 0, SEEK_SET) != 0) {
+		fclose(fd);
+		cyaml_log_message("Failed to read file!");
+		return NULL;
+	}
+
+	if (end == 0) {
+		fclose(fd);
+		cyaml_log_message("File was empty!");
+		return NULL;
+	}
+
+	if ((unsigned long) end > max) {
+		fclose(fd);
+		cyaml_log_message("Document is larger than %zu bytes!", max);
+		return NULL;
+	}
+	fsize = (size_t) end;
+
+	buffer = cyaml_arena_push(arena, fsize + 1);
+	if (!buffer) {
+		fclose(fd);
+		return NULL;
+	}
+
+	nread = fread(buffer, sizeof(*buffer), fsize, fd);
+	if (nread != fsize) {
+		cyaml_arena_pop(arena, buffer, fsize + 1);
+		fclose(fd);
+		cyaml_log_message("Failed to read file!");
+		return NULL;
+	}
+
+	buffer[nread] = '\0';
+	fclose(fd);
+	*size = nread;
+	return buffer;
+}
+
+static cyaml_t *
+cyaml_create(cyaml_arena_t *arena, enum cyaml_storage_type type)
+{
+	cyaml_t *storage;
+	storage = cyaml_arena_calloc(arena, sizeof(*storage));
+	if (!storage) {
+		return NULL;
+	}
+	storage->type = type;
+	return storage;
+}
+
+/**
+ * @Internal: Creates a scalar of 'len' bytes copied from 'data', or left
+ * to be filled in if 'data' is NULL.
+ */
+static cyaml_t *
+cyaml_scalar_create(cyaml_arena_t *arena, char *data, size_t len)
+{
+	cyaml_t *storage;
+	storage = cyaml_create(arena, CYAML_STORAGE_SCALAR);
+	if (!storage) {
+		return NULL;
+	}
+
+	storage->storage.scalar = cyaml_arena_alloc(arena, len + 1);
+	if (!storage->storage.scalar) {
+		cyaml_arena_free(arena, storage, sizeof(*storage));
+		return NULL;
+	}
+	if (data) {
+		memcpy(storage->storage.scalar, data, len);
+	}
+	storage->storage.scalar[len] = '\0';
+	storage->size = len;
+	return storage;
+}
+
+/**
+ * @Internal: Makes room for one more element in a list or a mapping,
+ * doubling the capacity of its storage whenever it runs out.
+ */
+static int
+cyaml_reserve(cyaml_arena_t *arena, cyaml_t *cyaml, size_t element_size)
+{
+	void *data;
+	size_t capacity;
+	if (cyaml->size < cyaml->capacity) {
+		return 1;
+	}
+
+	capacity = cyaml->capacity ? cyaml->capacity * 2 : 4;
+	data = cyaml_arena_realloc(arena, cyaml->storage.items, cyaml->capacity * element_size,
+				   capacity * element_size);
+	if (!data) {
+		return 0;
+	}
+	cyaml->storage.items = data;
+	cyaml->capacity = capacity;
+	return 1;
+}
+
+static int
+cyaml_list_append(cyaml_arena_t *arena, cyaml_t *list, cyaml_t *item)
+{
+	if (!cyaml_reserve(arena, list, sizeof(*list->storage.items))) {
+		return 0;
+	}
+	list->storage.items[list->size++] = item;
+	return 1;
+}
+
+/**
+ * @Internal: Finds the node of the trie that the key ends at, or NULL
+ * if no key stored in the trie starts with 'key'.
+ */
+static cyaml_trie_t *
+cyaml_trie_find(cyaml_trie_t *trie, char *key, size_t len)
+{
+	size_t i = 0;
+	if (len == 0) {
+		return NULL;
+	}
+
+	while (trie) {
+		unsigned char c = key[i], character = trie->character;
+		if (c < character) {
+			trie = trie->left;
+		} else if (c > character) {
+			trie = trie->right;
+		} else if (++i < len) {
+			trie = trie->children;
+		} else {
+			return trie;
+		}
+	}
+	return NULL;
+}
+
+static int
+cyaml_trie_insert(cyaml_arena_t *arena, cyaml_trie_t **trie, char *key, size_t len, size_t index)
+{
+	size_t i = 0;
+	while (i < len) {
+		unsigned char c = key[i], character;
+		if (!*trie) {
+			*trie = cyaml_arena_calloc(arena, sizeof(**trie));
+			if (!*trie) {
+				return 0;
+			}
+			(*trie)->character = key[i];
+		}
+
+		character = (*trie)->character;
+		if (c < character) {
+			trie = &(*trie)->left;
+		} else if (c > character) {
+			trie = &(*trie)->right;
+		} else if (++i < len) {
+			trie = &(*trie)->children;
+		}
+	}
+
+	if (len == 0) {
+		cyaml_log_message("Empty key!");
+		return 0;
+	}
+
+	if ((*trie)->index) {
+		cyaml_log_message("Duplicate key '%.*s'!", (int) len, key);
+		return 0;
+	}
+	(*trie)->index = index + 1;
+	return 1;
+}
+
+static int
+cyaml_mapping_insert(cyaml_arena_t *arena, cyaml_t *mapping, char *key, size_t len, cyaml_t *value)
+{
+	cyaml_dict_t *entry;
+	if (!cyaml_reserve(arena, mapping, sizeof(*mapping->storage.data))) {
+		return 0;
+	}
+
+	if (!cyaml_trie_insert(arena, &mapping->index, key, len, mapping->size)) {
+		return 0;
+	}
+
+	entry = mapping->storage.data + mapping->size;
+	entry->key = cyaml_arena_alloc(arena, len + 1);
+	if (!entry->key) {
+		return 0;
+	}
+	memcpy(entry->key, key, len);
+	entry->key[len] = '\0';
+	entry->len = len;
+	entry->value = value;
+	mapping->size++;
+	return 1;
+}
+
+#define CYAML_HASH_K1 (0x9e3779b97f4a7c15ULL)
+#define CYAML_HASH_K2 (0xc2b2ae3d27d4eb4fULL)
+
+static inline uint64_t
+cyaml_hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+#define CYAML_HASH_ROTATE(h, bits) (((h) << (bits)) | ((h) >> (64 - (bits))))
+
+/**
+ * @Internal: Consumes 'data' 32 bytes at a time into four independent
+ * lanes, which the compiler keeps in vector registers or at least
+ * interleaves instead of waiting for one multiplication after the
+ * other, and folds them into 'h' and 'g'. Returns the bytes consumed.
+ */
+static size_t
+cyaml_hash_lanes(const char *data, size_t len, uint64_t *h, uint64_t *g)
+{
+	uint64_t lanes[4], word;
+	size_t i, done;
+	for (i = 0; i < 4; i++) {
+		lanes[i] = *h + i * CYAML_HASH_K2;
+	}
+
+	for (done = 0; len - done >= sizeof(lanes); done += sizeof(lanes)) {
+		for (i = 0; i < 4; i++) {
+			memcpy(&word, data + done + i * sizeof(word), sizeof(word));
+			lanes[i] ^= word * CYAML_HASH_K2;
+			lanes[i] = CYAML_HASH_ROTATE(lanes[i], 31) * CYAML_HASH_K1;
+		}
+	}
+
+	*h ^= CYAML_HASH_ROTATE(lanes[0], 1) + CYAML_HASH_ROTATE(lanes[1], 7)
+		+ CYAML_HASH_ROTATE(lanes[2], 12) + CYAML_HASH_ROTATE(lanes[3], 18);
+	*g ^= (lanes[0] * CYAML_HASH_K1) ^ CYAML_HASH_ROTATE(lanes[1] * CYAML_HASH_K2, 29)
+		^ CYAML_HASH_ROTATE(lanes[2] * CYAML_HASH_K1, 41)
+		^ CYAML_HASH_ROTATE(lanes[3] * CYAML_HASH_K2, 53);
+	return done;
+}
+
+/**
+ * @Internal: Hashes 'len' bytes of 'data' into 128 bits, storing the
+ * upper half in 'high' unless it is NULL. Short data, and what is left
+ * over by the lanes, is hashed eight bytes at a time, the upper half
+ * being a second chain with its own constants.
+ */
+static uint64_t
+cyaml_hash_wide(const char *data, size_t len, uint64_t seed, uint64_t *high)
+{
+	uint64_t word, h, g;
+	size_t done;
+	h = seed ^ (len * CYAML_HASH_K1);
+	g = h + CYAML_HASH_K2;
+	if (len >= 32) {
+		done = cyaml_hash_lanes(data, len, &h, &g);
+		data += done;
+		len -= done;
+	}
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		h ^= word * CYAML_HASH_K2;
+		h = CYAML_HASH_ROTATE(h, 27) * CYAML_HASH_K1;
+		if (high) {
+			g ^= word * CYAML_HASH_K1;
+			g = CYAML_HASH_ROTATE(g, 31) * CYAML_HASH_K2;
+		}
+		data += sizeof(word);
+		len -= sizeof(word);
+	}
+
+	if (len > 0) {
+		word = 0;
+		memcpy(&word, data, len);
+		h ^= word * CYAML_HASH_K2;
+		h = CYAML_HASH_ROTATE(h, 27) * CYAML_HASH_K1;
+		if (high) {
+			g ^= word * CYAML_HASH_K1;
+			g = CYAML_HASH_ROTATE(g, 31) * CYAML_HASH_K2;
+		}
+	}
+
+	if (high) {
+		*high = cyaml_hash_mix(g);
+	}
+	return cyaml_hash_mix(h);
+}
+
+static inline uint64_t
+cyaml_hash(const char *data, size_t len, uint64_t seed)
+{
+	return cyaml_hash_wide(data, len, seed, NULL);
+}
+
+#define CYAML_PHASH_DIRECT ((uint32_t) 1 << 31)
+
+static inline size_t
+cyaml_phash_bucket(cyaml_phash_t *perfect, uint64_t h)
+{
+	return (size_t) ((h >> 32) % perfect->buckets);
+}
+
+static inline size_t
+cyaml_phash_slot(uint64_t h, uint32_t displacement, size_t size)
+{
+	if (displacement & CYAML_PHASH_DIRECT) {
+		return displacement & ~CYAML_PHASH_DIRECT;
+	}
+	return (size_t) (cyaml_hash_mix(h + displacement * CYAML_HASH_K1) % size);
+}
+
+/**
+ * @Internal: Searches a displacement that sends every key of a bucket
+ * to a distinct free slot, and claims those slots.
+ */
+static int
+cyaml_phash_place(cyaml_phash_t *perfect, size_t n, uint64_t *hashes,
+		  size_t *keys, size_t size, uint32_t *displacement)
+{
+	size_t i, j, slot;
+	uint32_t d;
+	for (d = 0; d < CYAML_FREEZE_ATTEMPTS; d++) {
+		for (i = 0; i < size; i++) {
+			slot = cyaml_phash_slot(hashes[keys[i]], d, n);
+			if (perfect->slots[slot] != UINT32_MAX) {
+				break;
+			}
+			perfect->slots[slot] = (uint32_t) keys[i];
+		}
+
+		if (i == size) {
+			*displacement = d;
+			return 1;
+		}
+
+		for (j = 0; j < i; j++) {
+			perfect->slots[cyaml_phash_slot(hashes[keys[j]], d, n)] = UINT32_MAX;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @Internal: Builds a minimal perfect hash over the keys of 'mapping'
+ * by hashing and displacing: keys are grouped into buckets, and the
+ * buckets, largest first, search for a displacement that sends all of
+ * their keys to free slots. Buckets with a single key simply take the
+ * next free slot. Returns NULL if no displacement could be found.
+ */
+static cyaml_phash_t *
+cyaml_phash_build(cyaml_arena_t *arena, cyaml_t *mapping, uint64_t seed)
+{
+	cyaml_phash_t *perfect;
+	uint64_t *hashes;
+	size_t *start, *cursor, *keys, *order, *sizes;
+	size_t n = mapping->size, buckets = n / 2 + 1, i, b, s, size, position;
+	size_t perfect_size = sizeof(*perfect) + (buckets + n) * sizeof(uint32_t);
+	size_t start_size = (3 * buckets + 2 * n + 2) * sizeof(*start);
+	hashes = cyaml_arena_push(arena, n * sizeof(*hashes));
+	start = hashes ? cyaml_arena_push(arena, start_size) : NULL;
+	perfect = start ? cyaml_arena_alloc(arena, perfect_size) : NULL;
+	if (!perfect) {
+		if (start) {
+			cyaml_arena_pop(arena, start, start_size);
+		}
+
+		if (hashes) {
+			cyaml_arena_pop(arena, hashes, n * sizeof(*hashes));
+		}
+		return NULL;
+	}
+
+	memset(start, 0, start_size);
+	perfect->seed = seed;
+	perfect->buckets = buckets;
+	perfect->displacements = (uint32_t *) (perfect + 1);
+	perfect->slots = perfect->displacements + buckets;
+	memset(perfect->displacements, 0, buckets * sizeof(uint32_t));
+	memset(perfect->slots, 0xff, n * sizeof(uint32_t));
+	cursor = start + buckets + 1;
+	order = cursor + buckets;
+	keys = order + buckets;
+	sizes = keys + n;
+
+	/* group the keys by bucket, then order the buckets by their size */
+	for (i = 0; i < n; i++) {
+		hashes[i] = cyaml_hash(mapping->storage.data[i].key, mapping->storage.data[i].len, seed);
+		start[cyaml_phash_bucket(perfect, hashes[i]) + 1]++;
+	}
+
+	for (b = 0; b < buckets; b++) {
+		sizes[start[b + 1]]++;
+		start[b + 1] += start[b];
+		cursor[b] = start[b];
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[cursor[cyaml_phash_bucket(perfect, hashes[i])]++] = i;
+	}
+
+	for (s = n + 1, position = 0; s-- > 0; ) {
+		size = sizes[s];
+		sizes[s] = position;
+		position += size;
+	}
+
+	for (b = 0; b < buckets; b++) {
+		order[sizes[start[b + 1] - start[b]]++] = b;
+	}
+
+	position = 0;
+	for (i = 0; i < buckets; i++) {
+		b = order[i];
+		size = start[b + 1] - start[b];
+		if (size > 1) {
+			if (!cyaml_phash_place(perfect, n, hashes, keys + start[b], size,
+					       perfect->displacements + b)) {
+				cyaml_arena_free(arena, perfect, perfect_size);
+				perfect = NULL;
+				break;
+			}
+		} else if (size == 1) {
+			while (perfect->slots[position] != UINT32_MAX) {
+				position++;
+			}
+			perfect->slots[position] = (uint32_t) keys[start[b]];
+			perfect->displacements[b] = (uint32_t) position | CYAML_PHASH_DIRECT;
+		}
+	}
+
+	cyaml_arena_pop(arena, start, start_size);
+	cyaml_arena_pop(arena, hashes, n * sizeof(*hashes));
+	return perfect;
+}
+
+static cyaml_dict_t *
+cyaml_phash_find(cyaml_t *mapping, char *key, size_t len)
+{
+	cyaml_phash_t *perfect = CYAML_LOAD_ACQUIRE(mapping->perfect);
+	cyaml_dict_t *entry;
+	uint64_t h;
+	h = cyaml_hash(key, len, perfect->seed);
+	entry = mapping->storage.data + perfect->slots[
+		cyaml_phash_slot(h, perfect->displacements[cyaml_phash_bucket(perfect, h)],
+				 mapping->size)];
+	if (entry->len != len || memcmp(entry->key, key, len) != 0) {
+		return NULL;
+	}
+	return entry;
+}
+
+static cyaml_t *
+cyaml_mapping_find(cyaml_t *mapping, char *key, size_t len)
+{
+	cyaml_trie_t *trie;
+	if (mapping->type != CYAML_STORAGE_MAPPING) {
+		return NULL;
+	}
+
+	if (CYAML_LOAD_ACQUIRE(mapping->perfect)) {
+		cyaml_dict_t *entry = cyaml_phash_find(mapping, key, len);
+		return entry ? entry->value : NULL;
+	}
+
+	trie = cyaml_trie_find(mapping->index, key, len);
+	if (!trie || !trie->index) {
+		return NULL;
+	}
+	return mapping->storage.data[trie->index - 1].value;
+}
+
+/**
+ * @Internal: The content hash of a node covers its type and everything
+ * below it. The items of a list are folded in one after another, while
+ * the entries of a mapping are summed up so that the order of its keys
+ * does not matter. Both halves of a 128-bit hash are built the same
+ * way from different seeds.
+ */
+#define CYAML_HASH_SEED(type) cyaml_hash_mix(((uint64_t) (type) + 1) * CYAML_HASH_K2)
+#define CYAML_HASH_SEED_HIGH(type) cyaml_hash_mix(((uint64_t) (type) + 4) * CYAML_HASH_K2)
+
+static inline void
+cyaml_hash_node(cyaml_t *cyaml, enum cyaml_hashing hashing)
+{
+	if (hashing == CYAML_HASH_NONE) {
+		return;
+	}
+
+	if (cyaml->type == CYAML_STORAGE_SCALAR) {
+		cyaml->hash = cyaml_hash_wide(cyaml->storage.scalar, cyaml->size,
+					      CYAML_HASH_SEED(cyaml->type),
+					      hashing == CYAML_HASH_128 ? &cyaml->hash_high : NULL);
+		cyaml->hash = cyaml->hash ? cyaml->hash : 1;
+		return;
+	}
+
+	cyaml->hash = CYAML_HASH_SEED(cyaml->type);
+	if (hashing == CYAML_HASH_128) {
+		cyaml->hash_high = CYAML_HASH_SEED_HIGH(cyaml->type);
+	}
+}
+
+static inline void
+cyaml_hash_item(cyaml_t *list, cyaml_t *item, enum cyaml_hashing hashing)
+{
+	if (hashing == CYAML_HASH_NONE) {
+		return;
+	}
+
+	list->hash = cyaml_hash_mix(list->hash ^ item->hash) + CYAML_HASH_K1;
+	if (hashing == CYAML_HASH_128) {
+		list->hash_high = cyaml_hash_mix(list->hash_high ^ item->hash_high) + CYAML_HASH_K2;
+	}
+}
+
+static inline void
+cyaml_hash_entry(cyaml_t *mapping, cyaml_dict_t *entry, enum cyaml_hashing hashing)
+{
+	uint64_t high;
+	if (hashing == CYAML_HASH_NONE) {
+		return;
+	}
+
+	entry->hash = cyaml_hash_wide(entry->key, entry->len, CYAML_HASH_K1,
+				      hashing == CYAML_HASH_128 ? &high : NULL);
+	entry->hash = cyaml_hash_mix(entry->hash ^ entry->value->hash);
+	mapping->hash += entry->hash;
+	if (hashing == CYAML_HASH_128) {
+		mapping->hash_high += cyaml_hash_mix(high ^ entry->value->hash_high);
+	}
+}
+
+static inline uint64_t
+cyaml_hash_child(cyaml_t *cyaml, size_t i)
+{
+	if (cyaml->type == CYAML_STORAGE_MAPPING) {
+		return cyaml->storage.data[i].hash;
+	}
+	return cyaml_hash_mix(cyaml->storage.items[i]->hash ^ ((i % CYAML_HASH_BLOCK + 1) * CYAML_HASH_K2));
+}
+
+/**
+ * @Internal: Completes the hash of a list or a mapping, which is never
+ * 0 so that 0 can stand for no hash. Large ones also get the sums of
+ * the hashes of every CYAML_HASH_BLOCK items or entries, the items by
+ * their position in the block, which lets 'cyaml_diff' skip unchanged
+ * stretches of them.
+ */
+static int
+cyaml_hash_finish(cyaml_arena_t *arena, cyaml_t *cyaml, enum cyaml_hashing hashing)
+{
+	size_t i;
+	if (hashing == CYAML_HASH_NONE) {
+		return 1;
+	}
+
+	cyaml->hash = cyaml->hash ? cyaml->hash : 1;
+	if (cyaml->size <= CYAML_HASH_BLOCK) {
+		return 1;
+	}
+
+	cyaml->blocks = cyaml_arena_calloc(arena, (cyaml->size + CYAML_HASH_BLOCK - 1)
+					   / CYAML_HASH_BLOCK * sizeof(*cyaml->blocks));
+	if (!cyaml->blocks) {
+		return 0;
+	}
+
+	for (i = 0; i < cyaml->size; i++) {
+		cyaml->blocks[i / CYAML_HASH_BLOCK] += cyaml_hash_child(cyaml, i);
+	}
+	return 1;
+}
+
+/**
+ * @Internal: The nodes of a document parsed with 'options.share', an
+ * open addressing table over their hashes. Nodes are added bottom up,
+ * so equal nodes already have the very same children and comparing
+ * them is shallow.
+ */
+typedef struct cyaml_share_t {
+	cyaml_t **nodes;
+	size_t size;
+	size_t capacity;
+} cyaml_share_t;
+
+static int
+cyaml_share_equal(cyaml_t *a, cyaml_t *b)
+{
+	size_t i;
+	if (a->type != b->type || a->size != b->size || a->hash != b->hash
+	    || a->hash_high != b->hash_high) {
+		return 0;
+	}
+
+	switch (a->type) {
+	case CYAML_STORAGE_SCALAR:
+		return memcmp(a->storage.scalar, b->storage.scalar, a->size) == 0;
+	case CYAML_STORAGE_LIST:
+		for (i = 0; i < a->size; i++) {
+			if (a->storage.items[i] != b->storage.items[i]) {
+				return 0;
+			}
+		}
+		return 1;
+	case CYAML_STORAGE_MAPPING:
+		for (i = 0; i < a->size; i++) {
+			if (a->storage.data[i].value != b->storage.data[i].value
+			    || a->storage.data[i].len != b->storage.data[i].len
+			    || memcmp(a->storage.data[i].key, b->storage.data[i].key, a->storage.data[i].len)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @Internal: Doubles the table. It lives on the top of the arena, so
+ * with a buffer the larger table is moved down into the place of the
+ * old one to keep the top in order.
+ */
+static int
+cyaml_share_grow(cyaml_share_t *share, cyaml_arena_t *arena)
+{
+	cyaml_t **nodes;
+	size_t capacity, i, j;
+	capacity = share->capacity ? share->capacity * 2 : 256;
+	nodes = cyaml_arena_push(arena, capacity * sizeof(*nodes));
+	if (!nodes) {
+		return 0;
+	}
+
+	memset(nodes, 0, capacity * sizeof(*nodes));
+	for (i = 0; i < share->capacity; i++) {
+		if (share->nodes[i]) {
+			for (j = share->nodes[i]->hash & (capacity - 1); nodes[j]; j = (j + 1) & (capacity - 1));
+			nodes[j] = share->nodes[i];
+		}
+	}
+
+	if (CYAML_ARENA_FIXEDP(arena) && share->nodes) {
+		cyaml_arena_pop(arena, nodes, capacity * sizeof(*nodes));
+		cyaml_arena_pop(arena, share->nodes, share->capacity * sizeof(*nodes));
+		nodes = memmove(cyaml_arena_push(arena, capacity * sizeof(*nodes)), nodes,
+				capacity * sizeof(*nodes));
+	} else {
+		cyaml_arena_pop(arena, share->nodes, share->capacity * sizeof(*nodes));
+	}
+	share->nodes = nodes;
+	share->capacity = capacity;
+	return 1;
+}
+
+/**
+ * @Internal: Returns the node equal to 'cyaml' that was added before,
+ * rewinding 'arena' to 'mark' (taken before 'cyaml' was allocated) to
+ * drop the duplicate, or adds 'cyaml' and returns it.
+ */
+static cyaml_t *
+cyaml_share(cyaml_share_t *share, cyaml_arena_t *arena, cyaml_t *cyaml, cyaml_mark_t *mark)
+{
+	size_t i;
+	if (share->size >= share->capacity / 2 && !cyaml_share_grow(share, arena)) {
+		return NULL;
+	}
+
+	for (i = cyaml->hash & (share->capacity - 1); share->nodes[i]; i = (i + 1) & (share->capacity - 1)) {
+		if (cyaml_share_equal(share->nodes[i], cyaml)) {
+			cyaml_arena_rewind(arena, mark);
+			return share->nodes[i];
+		}
+	}
+	share->nodes[i] = cyaml;
+	share->size++;
+	return cyaml;
+}
+
+/**
+ * @Internal: A list or mapping the parser is in the middle of, 'key'
+ * being the key whose value is parsed next. A block that begins on an
+ * indented line ends with the UNDENT closing that line's level, any
+ * other block (the document, or a list at the level of its key) ends
+ * with the block around it.
+ */
+typedef struct cyaml_frame_t {
+	cyaml_t *node;
+	cyaml_token_t key;
+	cyaml_mark_t mark;
+	int indented;
+} cyaml_frame_t;
+
+/**
+ * @Internal: Where 'cyaml_parse_run' is in a document, see there.
+ */
+enum cyaml_parse_state {
+	CYAML_PARSE_START,
+	CYAML_PARSE_NODE,
+	CYAML_PARSE_ITEM,
+	CYAML_PARSE_ENTRY,
+	CYAML_PARSE_VALUE,
+	CYAML_PARSE_NEXT
+};
+
+/**
+ * @Internal: The state of a parse, 'token' being the token currently
+ * looked at, which was taken from the ring of 'lexer'. The open
+ * blocks are kept in 'frames', innermost last, which starts out in
+ * 'frames_fixed' and grows on the arena. A parse that yields keeps
+ * where it was in 'state', 'value' and 'indented'.
+ */
+typedef struct cyaml_parser_t {
+	cyaml_lexer_t lexer;
+	cyaml_token_t token;
+	enum cyaml_parse_state state;
+	cyaml_t *value;
+	int indented;
+	size_t depth;
+	size_t nodes;
+	size_t expansion; /* nodes that repeated includes point to again */
+	cyaml_options_t options;
+	cyaml_arena_t *arena;
+	cyaml_share_t *share; /* NULL unless 'options.share' */
+	char *path; /* of the file being parsed, NULL for memory */
+	size_t path_len;
+	struct cyaml_include_t **includes;
+	cyaml_frame_t *frames;
+	size_t frames_size;
+	size_t frames_capacity;
+	cyaml_frame_t frames_fixed[CYAML_INDENT_STACK];
+} cyaml_parser_t;
+
+/**
+ * @Internal: A file included by a document, parsed once no matter how
+ * often it is included. The same subtree is used for every include.
+ * On Linux a file is known by its device and inode, so that 'a.yaml',
+ * './a.yaml' and links to it are one file; elsewhere by its path.
+ */
+typedef struct cyaml_include_t {
+	struct cyaml_include_t *next;
+	char *path;
+	cyaml_t *root; /* NULL while the file is being parsed */
+	size_t nodes;  /* of the tree 'root' expands to */
+	uint64_t device;
+	uint64_t inode; /* 0 if unknown */
+} cyaml_include_t;
+
+/**
+ * @Internal: Finds out which file 'include->path' is, leaving it
+ * unknown if it cannot be looked at (reading it fails later on).
+ */
+static void
+cyaml_include_identify(cyaml_include_t *include)
+{
+#ifdef __linux__
+	struct stat st;
+	if (stat(include->path, &st) == 0) {
+		include->device = (uint64_t) st.st_dev;
+		include->inode = (uint64_t) st.st_ino;
+	}
+#else /* !defined(__linux__) */
+	(void) include;
+#endif /* __linux__ */
+}
+
+/**
+ * @Internal: Tells whether 'a' and 'b' are the same file.
+ */
+static int
+cyaml_include_same(cyaml_include_t *a, cyaml_include_t *b)
+{
+	if (a->inode || b->inode) {
+		return a->device == b->device && a->inode == b->inode;
+	}
+	return strcmp(a->path, b->path) == 0;
+}
+
+#define CYAML_PARSER_GET(parser) ((parser)->token = cyaml_token_get(&(parser)->lexer))
+#define CYAML_PARSER_PEEK(parser) (cyaml_token_peek(&(parser)->lexer, 0))
+
+/**
+ * @Internal: Starts 'parser' at the beginning of 'buffer'.
+ */
+static void
+cyaml_parser_start(cyaml_parser_t *parser, char *buffer)
+{
+	cyaml_lexer_init(&parser->lexer, buffer, parser->arena);
+	parser->state = CYAML_PARSE_START;
+	parser->value = NULL;
+	parser->indented = 0;
+	parser->frames = parser->frames_fixed;
+	parser->frames_size = 0;
+	parser->frames_capacity = CYAML_INDENT_STACK;
+}
+
+/**
+ * @Internal: Gives back the stacks 'parser' grew on the arena.
+ */
+static void
+cyaml_parser_finish(cyaml_parser_t *parser)
+{
+	if (parser->frames != parser->frames_fixed) {
+		cyaml_arena_pop(parser->arena, parser->frames,
+				parser->frames_capacity * sizeof(*parser->frames));
+	}
+	cyaml_lexer_free(&parser->lexer);
+}
+
+/**
+ * @Internal: Why 'token' cannot come where it does, NULL for an error
+ * token without text, whose error was reported when it was made.
+ */
+static const char *
+cyaml_token_unexpected(cyaml_token_t token)
+{
+	if (CYAML_TOKEN_ERRORP(token)) {
+		return token.len ? token.data : NULL;
+	}
+	return CYAML_TOKEN_LINEP(token) ? "Inconsistent indentation!" : "Unexpected token!";
+}
+
+static void
+cyaml_parse_unexpected(cyaml_parser_t *parser)
+{
+	const char *message = cyaml_token_unexpected(parser->token);
+	if (message) {
+		cyaml_log_message("%s", message);
+	}
+}
+
+static cyaml_t *
+cyaml_parse_create(cyaml_parser_t *parser, enum cyaml_storage_type type)
+{
+	cyaml_t *storage;
+	if (++parser->nodes > parser->options.max_nodes) {
+		cyaml_log_message("Document has more than %zu nodes!", parser->options.max_nodes);
+		return NULL;
+	}
+
+	storage = cyaml_create(parser->arena, type);
+	if (storage) {
+		cyaml_hash_node(storage, parser->options.hash);
+	}
+	return storage;
+}
+
+/**
+ * @Internal: The value of the variable 'name' of 'len' bytes, at most
+ * CYAML_MAX_VAR_NAME, or NULL if it is not set.
+ */
+static char *
+cyaml_getenv(char *name, size_t len)
+{
+	char key[CYAML_MAX_VAR_NAME + 1];
+	memcpy(key, name, len);
+	key[len] = '\0';
+	return getenv(key);
+}
+
+/**
+ * @Internal: Replaces every ${VAR} in 'data' with the value of the
+ * environment variable VAR, or with 'default' for ${VAR:-default} if
+ * VAR is not set. Returns the length of the result, which is written to
+ * 'out' unless it is NULL, or SIZE_MAX if a variable is not set.
+ */
+static size_t
+cyaml_expand(char *out, char *data, size_t len)
+{
+	char *dollar, *close, *fallback, *value;
+	size_t i = 0, n = 0, span, name_len, value_len;
+	while (i < len) {
+		dollar = memchr(data + i, '$', len - i);
+		span = dollar ? (size_t) (dollar - data) - i : len - i;
+		if (out) {
+			memcpy(out + n, data + i, span);
+		}
+		n += span;
+		i += span;
+		if (i >= len) {
+			break;
+		}
+
+		if (i + 1 == len || data[i + 1] != '{') {
+			if (out) {
+				out[n] = '$';
+			}
+			n++;
+			i++;
+			continue;
+		}
+
+		close = memchr(data + i + 2, '}', len - i - 2);
+		if (!close) {
+			cyaml_log_message("Unterminated placeholder!");
+			return SIZE_MAX;
+		}
+
+		name_len = (size_t) (close - data) - i - 2;
+		for (fallback = data + i + 2; fallback + 1 < close; fallback++) {
+			if (fallback[0] == ':' && fallback[1] == '-') {
+				name_len = (size_t) (fallback - data) - i - 2;
+				break;
+			}
+		}
+
+		if (name_len > CYAML_MAX_VAR_NAME) {
+			cyaml_log_message("Variable name is longer than %d bytes!", CYAML_MAX_VAR_NAME);
+			return SIZE_MAX;
+		}
+
+		value = cyaml_getenv(data + i + 2, name_len);
+		if (value) {
+			value_len = strlen(value);
+		} else if (fallback + 1 < close) {
+			value = fallback + 2;
+			value_len = (size_t) (close - value);
+		} else {
+			cyaml_log_message("Variable '%.*s' is not set!", (int) name_len, data + i + 2);
+			return SIZE_MAX;
+		}
+
+		if (out) {
+			memcpy(out + n, value, value_len);
+		}
+		n += value_len;
+		i = (size_t) (close - data) + 1;
+	}
+	return n;
+}
+
+/**
+ * @Internal: Creates a scalar of the text 'data', substituting the
+ * placeholders in it with 'options.expand' straight into the arena.
+ */
+static cyaml_t *
+cyaml_parse_scalar(cyaml_parser_t *parser, char *data, size_t len)
+{
+	cyaml_t *storage;
+	cyaml_mark_t mark;
+	size_t size = len;
+	int expand = parser->options.expand && memchr(data, '$', len);
+	if (++parser->nodes > parser->options.max_nodes) {
+		cyaml_log_message("Document has more than %zu nodes!", parser->options.max_nodes);
+		return NULL;
+	}
+
+	if (expand) {
+		size = cyaml_expand(NULL, data, len);
+		if (size == SIZE_MAX) {
+			return NULL;
+		}
+	}
+
+	if (size > parser->options.max_scalar) {
+		cyaml_log_message("Scalar is longer than %zu bytes!", parser->options.max_scalar);
+		return NULL;
+	}
+
+	cyaml_arena_mark(parser->arena, &mark);
+	storage = cyaml_scalar_create(parser->arena, expand ? NULL : data, size);
+	if (!storage) {
+		return NULL;
+	}
+
+	if (expand) {
+		cyaml_expand(storage->storage.scalar, data, len);
+	}
+
+	cyaml_hash_node(storage, parser->options.hash);
+	return parser->share ? cyaml_share(parser->share, parser->arena, storage, &mark) : storage;
+}
+
+static int
+cyaml_parse_enter(cyaml_parser_t *parser)
+{
+	if (++parser->depth > parser->options.max_depth) {
+		cyaml_log_message("Document is nested deeper than %zu levels!",
+				  parser->options.max_depth);
+		return 0;
+	}
+	return 1;
+}
+
+static cyaml_t *
+cyaml_parse_root(cyaml_parser_t *parser);
+
+/**
+ * @Internal: Counts the 'nodes' of a file included once more, which the
+ * document now points to a second time. Walks over the document visit
+ * them as often as they are included, so they count towards
+ * 'max_nodes' as well.
+ */
+static int
+cyaml_parse_charge(cyaml_parser_t *parser, size_t nodes)
+{
+	parser->nodes = nodes > SIZE_MAX - parser->nodes ? SIZE_MAX : parser->nodes + nodes;
+	parser->expansion = nodes > SIZE_MAX - parser->expansion ? SIZE_MAX : parser->expansion + nodes;
+	if (parser->nodes > parser->options.max_nodes) {
+		cyaml_log_message("Document has more than %zu nodes!", parser->options.max_nodes);
+		return 0;
+	}
+	if (parser->expansion > parser->options.max_expansion) {
+		cyaml_log_message("Includes expand to more than %zu nodes!", parser->options.max_expansion);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @Internal: Parses the file 'name' is expanded to, relative to the
+ * directory of the file being parsed, for an '!include' value.
+ */
+static cyaml_t *
+cyaml_parse_include(cyaml_parser_t *parser, char *name, size_t len)
+{
+	cyaml_parser_t *nested;
+	cyaml_include_t *include, *failed, file = { 0 };
+	cyaml_mark_t mark;
+	cyaml_t *root;
+	char *path, *buffer;
+	size_t dir = 0, path_len, size, nodes;
+	path_len = cyaml_expand(NULL, name, len);
+	if (path_len == SIZE_MAX) {
+		return NULL;
+	}
+
+	if (parser->path) {
+		for (dir = parser->path_len; dir > 0 && parser->path[dir - 1] != '/'; dir--);
+	}
+
+	cyaml_arena_mark(parser->arena, &mark);
+	path = cyaml_arena_alloc(parser->arena, dir + path_len + 1);
+	if (!path) {
+		return NULL;
+	}
+
+	cyaml_expand(path + dir, name, len);
+	if (path[dir] == '/') {
+		memmove(path, path + dir, path_len);
+	} else if (dir) {
+		memcpy(path, parser->path, dir);
+		path_len += dir;
+	}
+	path[path_len] = '\0';
+
+	file.path = path;
+	cyaml_include_identify(&file);
+	for (include = *parser->includes; include; include = include->next) {
+		if (cyaml_include_same(include, &file)) {
+			if (!include->root) {
+				cyaml_log_message("Include cycle through '%s'!", path);
+			}
+			cyaml_arena_rewind(parser->arena, &mark);
+			if (include->root && !cyaml_parse_charge(parser, include->nodes)) {
+				return NULL;
+			}
+			return include->root;
+		}
+	}
+
+	include = cyaml_arena_calloc(parser->arena, sizeof(*include));
+	if (!include) {
+		return NULL;
+	}
+	*include = file;
+	include->next = *parser->includes;
+	*parser->includes = include;
+
+	buffer = cyaml_read_file(parser->arena, path, path_len, &size, parser->options.max_bytes);
+	if (!buffer) {
+		cyaml_log_message("Failed to include '%s'!", path);
+		return NULL;
+	}
+
+	/* the parser of an included file is kept off the stack, but the
+	 * parse still recurses, so a chain of includes counts as nesting */
+	nested = cyaml_parse_enter(parser) ? cyaml_arena_push(parser->arena, sizeof(*nested)) : NULL;
+	if (!nested) {
+		cyaml_arena_pop(parser->arena, buffer, size + 1);
+		return NULL;
+	}
+
+	nodes = parser->nodes;
+	*nested = *parser;
+	nested->path = path;
+	nested->path_len = path_len;
+	cyaml_parser_start(nested, buffer);
+	if (memchr(buffer, '\0', size)) {
+		cyaml_log_message("Unexpected nul byte!");
+		root = NULL;
+	} else {
+		root = cyaml_parse_root(nested);
+	}
+	cyaml_parser_finish(nested);
+	parser->nodes = nested->nodes;
+	parser->expansion = nested->expansion;
+	parser->depth--;
+	cyaml_arena_pop(parser->arena, nested, sizeof(*nested));
+	cyaml_arena_pop(parser->arena, buffer, size + 1);
+	if (!root) {
+		/* files included after this one that failed were reported
+		 * already, the message saying why must stay on the log */
+		for (failed = *parser->includes; failed != include && failed->root; failed = failed->next);
+		if (failed == include) {
+			cyaml_log_message("Failed to include '%s'!", path);
+		}
+		return NULL;
+	}
+	include->root = root;
+	include->nodes = parser->nodes - nodes;
+	return root;
+}
+
+/**
+ * @Internal: Parses the value the current token stands for, which is an
+ * included file for '!include path' with 'options.expand'.
+ */
+static cyaml_t *
+cyaml_parse_value(cyaml_parser_t *parser)
+{
+	cyaml_token_t token = parser->token;
+	size_t skip;
+	if (parser->options.expand && CYAML_TOKEN_KEYP(token) && token.len > 8
+	    && memcmp(token.data, "!include", 8) == 0 && (token.data[8] == ' ' || token.data[8] == '\t')) {
+		skip = 8 + strspn(token.data + 8, " \t");
+		return cyaml_parse_include(parser, token.data + skip, token.len - skip);
+	}
+	return cyaml_parse_scalar(parser, token.data, token.len);
+}
+
+/**
+ * @Internal: Opens a list or mapping, 'indented' if it begins on a line
+ * of its own.
+ */
+static cyaml_frame_t *
+cyaml_parse_push(cyaml_parser_t *parser, enum cyaml_storage_type type, int indented)
+{
+	cyaml_frame_t *frame, *frames;
+	if (!cyaml_parse_enter(parser)) {
+		return NULL;
+	}
+
+	if (parser->frames_size == parser->frames_capacity) {
+		frames = cyaml_stack_grow(parser->arena, parser->frames, &parser->frames_capacity,
+					  sizeof(*frames), parser->frames_fixed);
+		if (!frames) {
+			return NULL;
+		}
+		parser->frames = frames;
+	}
+
+	frame = &parser->frames[parser->frames_size];
+	cyaml_arena_mark(parser->arena, &frame->mark);
+	frame->node = cyaml_parse_create(parser, type);
+	if (!frame->node) {
+		return NULL;
+	}
+	frame->indented = indented;
+	parser->frames_size++;
+	return frame;
+}
+
+/**
+ * @Internal: Closes the innermost block, returning it as a value.
+ */
+static cyaml_t *
+cyaml_parse_pop(cyaml_parser_t *parser)
+{
+	cyaml_frame_t *frame = &parser->frames[--parser->frames_size];
+	if (!cyaml_hash_finish(parser->arena, frame->node, parser->options.hash)) {
+		return NULL;
+	}
+	parser->depth--;
+	return parser->share ? cyaml_share(parser->share, parser->arena, frame->node, &frame->mark)
+		: frame->node;
+}
+
+/**
+ * @Internal: Adds 'value' to the innermost block, as its next item or as
+ * the value of its pending key.
+ */
+static int
+cyaml_parse_add(cyaml_parser_t *parser, cyaml_t *value)
+{
+	cyaml_frame_t *frame = &parser->frames[parser->frames_size - 1];
+	cyaml_t *node = frame->node;
+	if (node->type == CYAML_STORAGE_LIST) {
+		if (!cyaml_list_append(parser->arena, node, value)) {
+			return 0;
+		}
+		cyaml_hash_item(node, value, parser->options.hash);
+		return 1;
+	}
+
+	if (!cyaml_mapping_insert(parser->arena, node, frame->key.data, frame->key.len, value)) {
+		return 0;
+	}
+	cyaml_hash_entry(node, node->storage.data + node->size - 1, parser->options.hash);
+	return 1;
+}
+
+/**
+ * @Internal: Parses a whole document (or included file) from the start
+ * of the buffer 'parser' was started at in a single pass. Rather than
+ * recursing, the open blocks are kept in 'parser->frames': every UNDENT
+ * of the tokenizer closes the block that began on the level it closes,
+ * so a block never has to look at indentation to know where it ends.
+ *
+ * Once the parse reaches a node or value at offset 'until' of the
+ * buffer or beyond, it yields, returning CYAML_AGAIN to be called
+ * again. Done, the document is in 'parser->value'.
+ */
+static enum cyaml_status
+cyaml_parse_run(cyaml_parser_t *parser, size_t until)
+{
+	enum cyaml_parse_state state = parser->state;
+	cyaml_t *value = parser->value;
+	int indented = parser->indented, list;
+	cyaml_frame_t *frame;
+	cyaml_token_t ptoken;
+	for (;;) {
+		if ((state == CYAML_PARSE_NODE || (state == CYAML_PARSE_VALUE && parser->frames_size))
+		    && !CYAML_TOKEN_ERRORP(parser->token)
+		    && (size_t) (parser->token.data - parser->lexer.base) >= until) {
+			parser->state = state;
+			parser->value = value;
+			parser->indented = indented;
+			return CYAML_AGAIN;
+		}
+
+		switch (state) {
+		case CYAML_PARSE_START:
+			CYAML_PARSER_GET(parser);
+			if (CYAML_TOKEN_LINEP(parser->token)) {
+				indented = CYAML_TOKEN_INDENTP(parser->token);
+				CYAML_PARSER_GET(parser);
+			}
+
+			if (CYAML_TOKEN_ENDP(parser->token)) {
+				value = cyaml_parse_create(parser, CYAML_STORAGE_MAPPING);
+				if (!value || !cyaml_hash_finish(parser->arena, value, parser->options.hash)) {
+					return CYAML_FAILED;
+				}
+				parser->value = value;
+				return CYAML_DONE;
+			}
+			state = CYAML_PARSE_NODE;
+			break;
+		case CYAML_PARSE_NODE:
+			/* the first token of a node, which is all of its line's
+			 * level if 'indented' */
+			if (CYAML_TOKEN_DASHP(parser->token)) {
+				if (!cyaml_parse_push(parser, CYAML_STORAGE_LIST, indented)) {
+					return CYAML_FAILED;
+				}
+				state = CYAML_PARSE_ITEM;
+				break;
+			}
+
+			if (!CYAML_TOKEN_VALUEP(parser->token)) {
+				cyaml_parse_unexpected(parser);
+				return CYAML_FAILED;
+			}
+
+			ptoken = CYAML_PARSER_PEEK(parser);
+			if (CYAML_TOKEN_COLONP(ptoken)) {
+				if (!cyaml_parse_push(parser, CYAML_STORAGE_MAPPING, indented)) {
+					return CYAML_FAILED;
+				}
+				state = CYAML_PARSE_ENTRY;
+				break;
+			}
+
+			value = cyaml_parse_value(parser);
+			if (!value) {
+				return CYAML_FAILED;
+			}
+
+			CYAML_PARSER_GET(parser);
+			if (indented && !CYAML_TOKEN_UNDENTP(parser->token)) {
+				cyaml_parse_unexpected(parser);
+				return CYAML_FAILED;
+			} else if (indented) {
+				CYAML_PARSER_GET(parser);
+			}
+			state = CYAML_PARSE_VALUE;
+			break;
+		case CYAML_PARSE_ITEM:
+			/* the dash of a list item */
+			CYAML_PARSER_GET(parser);
+			if (CYAML_TOKEN_INDENTP(parser->token)) {
+				indented = 1;
+				CYAML_PARSER_GET(parser);
+				state = CYAML_PARSE_NODE;
+				break;
+			}
+
+			value = cyaml_parse_scalar(parser, "", 0);
+			if (!value) {
+				return CYAML_FAILED;
+			}
+			state = CYAML_PARSE_VALUE;
+			break;
+		case CYAML_PARSE_ENTRY:
+			/* the key of a mapping entry */
+			frame = &parser->frames[parser->frames_size - 1];
+			frame->key = parser->token;
+			if (frame->key.len > parser->options.max_scalar) {
+				cyaml_log_message("Scalar is longer than %zu bytes!", parser->options.max_scalar);
+				return CYAML_FAILED;
+			}
+
+			CYAML_PARSER_GET(parser);
+			if (!CYAML_TOKEN_COLONP(parser->token)) {
+				cyaml_log_message("Expected ':' after key!");
+				return CYAML_FAILED;
+			}
+
+			CYAML_PARSER_GET(parser);
+			if (CYAML_TOKEN_VALUEP(parser->token)) {
+				ptoken = CYAML_PARSER_PEEK(parser);
+				if (CYAML_TOKEN_COLONP(ptoken)) {
+					cyaml_log_message("Mappings must start on a new line!");
+					return CYAML_FAILED;
+				}
+
+				value = cyaml_parse_value(parser);
+				if (!value) {
+					return CYAML_FAILED;
+				}
+				CYAML_PARSER_GET(parser);
+				state = CYAML_PARSE_VALUE;
+			} else if (CYAML_TOKEN_INDENTP(parser->token)) {
+				indented = 1;
+				CYAML_PARSER_GET(parser);
+				state = CYAML_PARSE_NODE;
+			} else if (parser->token.type == CYAML_TOKEN_EMPTY
+				   && CYAML_TOKEN_DASHP(CYAML_PARSER_PEEK(parser))) {
+				/* a list at the level of its key */
+				indented = 0;
+				CYAML_PARSER_GET(parser);
+				state = CYAML_PARSE_NODE;
+			} else {
+				value = cyaml_parse_scalar(parser, "", 0);
+				if (!value) {
+					return CYAML_FAILED;
+				}
+				state = CYAML_PARSE_VALUE;
+			}
+			break;
+		case CYAML_PARSE_VALUE:
+			/* 'value' is done, the current token follows it */
+			if (parser->frames_size == 0) {
+				if (!CYAML_TOKEN_ENDP(parser->token)) {
+					cyaml_parse_unexpected(parser);
+					return CYAML_FAILED;
+				}
+				parser->value = value;
+				return CYAML_DONE;
+			}
+
+			if (!cyaml_parse_add(parser, value)) {
+				return CYAML_FAILED;
+			}
+			state = CYAML_PARSE_NEXT;
+			break;
+		case CYAML_PARSE_NEXT:
+			/* the innermost block either goes on with another line at
+			 * its level or ends */
+			frame = &parser->frames[parser->frames_size - 1];
+			list = frame->node->type == CYAML_STORAGE_LIST;
+			if (parser->token.type == CYAML_TOKEN_EMPTY) {
+				ptoken = CYAML_PARSER_PEEK(parser);
+				if (list ? CYAML_TOKEN_DASHP(ptoken) : CYAML_TOKEN_VALUEP(ptoken)) {
+					CYAML_PARSER_GET(parser);
+					state = list ? CYAML_PARSE_ITEM : CYAML_PARSE_ENTRY;
+					break;
+				}
+
+				/* only a list at the level of its key gives way to
+				 * the next key */
+				if (!list || frame->indented || parser->frames_size == 1
+				    || !CYAML_TOKEN_VALUEP(ptoken)) {
+					cyaml_parse_unexpected(parser);
+					return CYAML_FAILED;
+				}
+			} else if (!CYAML_TOKEN_UNDENTP(parser->token) && !CYAML_TOKEN_ENDP(parser->token)) {
+				cyaml_parse_unexpected(parser);
+				return CYAML_FAILED;
+			}
+
+			indented = frame->indented;
+			value = cyaml_parse_pop(parser);
+			if (!value) {
+				return CYAML_FAILED;
+			}
+
+			if (indented) {
+				CYAML_PARSER_GET(parser);
+			}
+			state = CYAML_PARSE_VALUE;
+			break;
+		}
+	}
+}
+
+static cyaml_t *
+cyaml_parse_root(cyaml_parser_t *parser)
+{
+	return cyaml_parse_run(parser, SIZE_MAX) == CYAML_DONE ? parser->value : NULL;
+}
+
+/**
+ * @Internal: Fills in the limits that were left at 0 with the defaults.
+ */
+static void
+cyaml_options_resolve(cyaml_options_t *resolved, cyaml_options_t *options)
+{
+	memset(resolved, 0, sizeof(*resolved));
+	if (options) {
+		*resolved = *options;
+	}
+
+	resolved->max_depth = resolved->max_depth ? resolved->max_depth : CYAML_MAX_DEPTH;
+	resolved->max_bytes = resolved->max_bytes ? resolved->max_bytes : CYAML_MAX_BYTES;
+	resolved->max_nodes = resolved->max_nodes ? resolved->max_nodes : CYAML_MAX_NODES;
+	resolved->max_scalar = resolved->max_scalar ? resolved->max_scalar : CYAML_MAX_SCALAR;
+	resolved->max_expansion = resolved->max_expansion ? resolved->max_expansion : CYAML_MAX_EXPANSION;
+	resolved->hash = resolved->hash ? resolved->hash : CYAML_HASHING;
+	if (resolved->share && resolved->hash == CYAML_HASH_NONE) {
+		resolved->hash = CYAML_HASH_64;
+	}
+}
+
+CYAMLDEF cyaml_t *
+cyaml_parse(char *s, size_t n, cyaml_loc_t loc)
+{
+	return cyaml_parse_opts(s, n, loc, NULL);
+}
+
+/**
+ * @Internal: Sets 'parser' up to parse into 'arena', with 'share' and
+ * 'includes' to keep the scalars and subtrees it shares and the files
+ * it includes in.
+ */
+static void
+cyaml_parser_init(cyaml_parser_t *parser, cyaml_arena_t *arena, cyaml_options_t *options,
+		  cyaml_share_t *share, cyaml_include_t **includes)
+{
+	memset(parser, 0, sizeof(*parser));
+	memset(share, 0, sizeof(*share));
+	parser->options = *options;
+	parser->arena = arena;
+	parser->share = options->share ? share : NULL;
+	parser->includes = includes;
+}
+
+/**
+ * @Internal: Ends the parse 'parser' ran over 'buffer', 'size' bytes
+ * pushed onto the arena whose top was at 'top' before, moving 'storage'
+ * into 'doc'. Everything the parse took from the top of the arena is
+ * given back, and all of the arena if 'storage' is NULL.
+ */
+static cyaml_t *
+cyaml_parse_end(cyaml_parser_t *parser, cyaml_doc_t *doc, cyaml_t *storage, char *buffer,
+		size_t size, size_t top)
+{
+	cyaml_arena_t *arena = parser->arena;
+	cyaml_parser_finish(parser);
+	if (parser->share) {
+		cyaml_arena_pop(arena, parser->share->nodes,
+				parser->share->capacity * sizeof(*parser->share->nodes));
+	}
+
+	cyaml_arena_pop(arena, buffer, size);
+	if (CYAML_ARENA_FIXEDP(arena)) {
+		arena->top = top;
+	}
+
+	if (!storage) {
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	/* the root moves into the document, what it owns stays in place */
+	doc->root = *storage;
+	doc->root.root = 1;
+	doc->shared = parser->share != NULL;
+	cyaml_arena_free(arena, storage, sizeof(*storage));
+	doc->arena = *arena;
+	CYAML_STAMP(doc);
+	return &doc->root;
+}
+
+#ifdef CYAML_HAVE_PIPELINE
+/**
+ * @Internal: Content lines the parser of a pipelined parse keeps out
+ * of, see 'cyaml_pipe_scan'.
+ */
+#define CYAML_PIPE_LINES (2 * CYAML_TOKEN_RING + 16)
+
+/**
+ * @Internal: A file being read into 'buffer' by a thread of its own
+ * while it is parsed. The reader has read 'ready' of its 'size' bytes,
+ * all that it will once 'done' is set, and stops early on 'stop'.
+ */
+typedef struct cyaml_pipe_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	char *buffer;
+	size_t size;
+	size_t ready;
+	int done;
+	int stop;
+} cyaml_pipe_t;
+
+/**
+ * @Internal: Where the parser of a pipelined parse may go. The text is
+ * scanned as it arrives, keeping track of strings as the tokenizer
+ * does, and the starts of the last CYAML_PIPE_LINES complete lines
+ * with content outside of strings are kept in 'lines'.
+ */
+typedef struct cyaml_pipe_scan_t {
+	size_t lines[CYAML_PIPE_LINES];
+	size_t count;
+	size_t line;
+	int content;
+	int string;
+	int escape;
+} cyaml_pipe_scan_t;
+
+/**
+ * @Internal: The reader of a pipelined parse, reading 'data' (a
+ * 'cyaml_pipe_t') CYAML_PIPELINE_CHUNK bytes at a time while the
+ * kernel reads the next chunk ahead.
+ */
+static void *
+cyaml_pipe_read(void *data)
+{
+	cyaml_pipe_t *reader = data;
+	size_t offset = 0, chunk;
+	ssize_t nread;
+	int stop = 0;
+	posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while (offset < reader->size && !stop) {
+		chunk = reader->size - offset;
+		chunk = chunk < CYAML_PIPELINE_CHUNK ? chunk : CYAML_PIPELINE_CHUNK;
+		posix_fadvise(reader->fd, (off_t) (offset + chunk), CYAML_PIPELINE_CHUNK, POSIX_FADV_WILLNEED);
+		nread = pread(reader->fd, reader->buffer + offset, chunk, (off_t) offset);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		} else if (nread <= 0) {
+			/* the parser finds the file short */
+			break;
+		}
+
+		offset += (size_t) nread;
+		pthread_mutex_lock(&reader->lock);
+		reader->ready = offset;
+		stop = reader->stop;
+		pthread_cond_signal(&reader->cond);
+		pthread_mutex_unlock(&reader->lock);
+	}
+
+	pthread_mutex_lock(&reader->lock);
+	reader->done = 1;
+	pthread_cond_signal(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+/**
+ * @Internal: Scans 'buffer' from 'from' up to 'to' into 'scan'. The
+ * tokenizer reads ahead of the parser, by a full ring of tokens at the
+ * most, and a token never reaches past the end of the next line with
+ * content. So once CYAML_PIPE_LINES such lines are complete, a parse
+ * that stops at the first of them never reads what has not arrived.
+ */
+static void
+cyaml_pipe_scan(cyaml_pipe_scan_t *scan, char *buffer, size_t from, size_t to)
+{
+	size_t i;
+	char c;
+	for (i = from; i < to; i++) {
+		c = buffer[i];
+		if (scan->string) {
+			if (scan->escape) {
+				scan->escape = 0;
+			} else if (c == '\\') {
+				scan->escape = 1;
+			} else if (c == '"') {
+				scan->string = 0;
+			}
+		} else if (c == '\n') {
+			if (scan->content) {
+				scan->lines[scan->count++ % CYAML_PIPE_LINES] = scan->line;
+			}
+			scan->line = i + 1;
+			scan->content = 0;
+		} else if (c != ' ' && c != '\t') {
+			scan->string = c == '"';
+			scan->content = 1;
+		}
+	}
+}
+
+/**
+ * @Internal: Parses the file 'path' into 'doc' with 'parser' while a
+ * thread of its own reads it, see 'cyaml_parse_opts'. The whole file
+ * is read into a single buffer, as the tokenizer wants it in one piece,
+ * and the parser follows the reader as closely as 'cyaml_pipe_scan'
+ * allows.
+ */
+static cyaml_t *
+cyaml_pipe_parse(cyaml_parser_t *parser, cyaml_doc_t *doc, char *path, size_t top)
+{
+	cyaml_arena_t *arena = parser->arena;
+	enum cyaml_status status = CYAML_AGAIN;
+	cyaml_pipe_scan_t scan;
+	cyaml_pipe_t reader;
+	pthread_t thread;
+	struct stat st;
+	size_t seen = 0, ready, until;
+	int done, threaded;
+
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = open(path, O_RDONLY);
+	if (reader.fd < 0) {
+		cyaml_log_message("Failed to open file!");
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	if (fstat(reader.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(reader.fd);
+		cyaml_log_message("Not a regular file!");
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	if (st.st_size <= 0) {
+		close(reader.fd);
+		cyaml_log_message("File was empty!");
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	if ((uintmax_t) st.st_size > parser->options.max_bytes) {
+		close(reader.fd);
+		cyaml_log_message("Document is larger than %zu bytes!", parser->options.max_bytes);
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	reader.size = (size_t) st.st_size;
+	reader.buffer = cyaml_arena_push(arena, reader.size + 1);
+	if (!reader.buffer) {
+		close(reader.fd);
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	/* without a thread the file is read before it is parsed */
+	pthread_mutex_init(&reader.lock, NULL);
+	pthread_cond_init(&reader.cond, NULL);
+	threaded = pthread_create(&thread, NULL, cyaml_pipe_read, &reader) == 0;
+	if (!threaded) {
+		cyaml_pipe_read(&reader);
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	reader.buffer[reader.size] = '\0';
+	cyaml_parser_start(parser, reader.buffer);
+	while (status == CYAML_AGAIN) {
+		pthread_mutex_lock(&reader.lock);
+		while (reader.ready == seen && !reader.done) {
+			pthread_cond_wait(&reader.cond, &reader.lock);
+		}
+		ready = reader.ready;
+		done = reader.done;
+		pthread_mutex_unlock(&reader.lock);
+
+		/* the tokenizer stops at the first nul, so it must not cut
+		 * the document short */
+		if (memchr(reader.buffer + seen, '\0', ready - seen)) {
+			cyaml_log_message("Unexpected nul byte!");
+			status = CYAML_FAILED;
+			break;
+		}
+		cyaml_pipe_scan(&scan, reader.buffer, seen, ready);
+		seen = ready;
+
+		if (done && ready < reader.size) {
+			cyaml_log_message("Failed to read file!");
+			status = CYAML_FAILED;
+			break;
+		} else if (done) {
+			until = SIZE_MAX;
+		} else if (scan.count >= CYAML_PIPE_LINES) {
+			until = scan.lines[scan.count % CYAML_PIPE_LINES];
+		} else {
+			continue;
+		}
+		status = cyaml_parse_run(parser, until);
+	}
+
+	if (threaded) {
+		pthread_mutex_lock(&reader.lock);
+		reader.stop = 1;
+		pthread_mutex_unlock(&reader.lock);
+		pthread_join(thread, NULL);
+	}
+	pthread_cond_destroy(&reader.cond);
+	pthread_mutex_destroy(&reader.lock);
+	close(reader.fd);
+	return cyaml_parse_end(parser, doc, status == CYAML_DONE ? parser->value : NULL,
+			       reader.buffer, reader.size + 1, top);
+}
+#endif /* CYAML_HAVE_PIPELINE */
+
+/**
+ * @Internal: Parses a document into 'arena'. The copy of the input is
+ * taken from the top of the arena and given back before returning, so
+ * only the document itself stays behind.
+ */
+static cyaml_t *
+cyaml_parse_arena(cyaml_arena_t *arena, char *s, size_t n, cyaml_loc_t loc,
+		  cyaml_options_t *options)
+{
+	cyaml_parser_t parser;
+	cyaml_include_t *includes = NULL, self;
+	cyaml_share_t share;
+	cyaml_doc_t *doc;
+	char *buffer, path[CYAML_MAX_PATH];
+	size_t size, top = arena->top;
+
+	cyaml_parser_init(&parser, arena, options, &share, &includes);
+	if (loc == CYAML_LOC_DISK) {
+		parser.path = s;
+		parser.path_len = n;
+	}
+
+	/* the document is being parsed, so including it is a cycle */
+	if (loc == CYAML_LOC_DISK) {
+		if (n >= CYAML_MAX_PATH) {
+			cyaml_log_message("Path is longer than %d bytes!", CYAML_MAX_PATH - 1);
+			return NULL;
+		}
+		memcpy(path, s, n);
+		path[n] = '\0';
+		memset(&self, 0, sizeof(self));
+		self.path = path;
+		cyaml_include_identify(&self);
+		includes = &self;
+	}
+	if (loc != CYAML_LOC_DISK && n > parser.options.max_bytes) {
+		cyaml_log_message("Document is larger than %zu bytes!", parser.options.max_bytes);
+		return NULL;
+	}
+
+	doc = cyaml_arena_calloc(arena, sizeof(*doc));
+	if (!doc) {
+		return NULL;
+	}
+
+#ifdef CYAML_HAVE_PIPELINE
+	if (loc == CYAML_LOC_DISK && parser.options.pipeline) {
+		return cyaml_pipe_parse(&parser, doc, path, top);
+	}
+#endif /* CYAML_HAVE_PIPELINE */
+
+	if (loc == CYAML_LOC_DISK) {
+		buffer = cyaml_read_file(arena, s, n, &size, parser.options.max_bytes);
+	} else {
+		buffer = cyaml_arena_push(arena, n + 1);
+		if (buffer) {
+			memcpy(buffer, s, n);
+			buffer[n] = '\0';
+		}
+		size = n;
+	}
+
+	if (!buffer) {
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	/* the tokenizer stops at the first nul, so it must not cut the
+	 * document short */
+	if (memchr(buffer, '\0', size)) {
+		cyaml_log_message("Unexpected nul byte!");
+		cyaml_arena_pop(arena, buffer, size + 1);
+		cyaml_arena_release(arena);
+		return NULL;
+	}
+
+	cyaml_parser_start(&parser, buffer);
+	return cyaml_parse_end(&parser, doc, cyaml_parse_root(&parser), buffer, size + 1, top);
+}
+
+#ifdef CYAML_HAVE_MMAP
+static cyaml_t *
+cyaml_cache_parse(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options);
+#endif /* CYAML_HAVE_MMAP */
+
+/**
+ * Parses a document with 'options'. With 'options->cache' naming a
+ * directory (ideally on tmpfs) shared by many processes, a document is
+ * looked up there by the hash of its text and, when some process has
+ * parsed it before, mapped frozen from the cache instead of being
+ * parsed again; otherwise it is parsed and added to the cache. Mapped
+ * documents share their memory until they are written to. The cache
+ * needs Linux and is ignored elsewhere or when parsing into a buffer.
+ * Only the header of an image and the offsets of its pointers are
+ * checked when it is mapped, not the pointers themselves, so the cache
+ * directory must only be writable by trusted processes: a crafted image
+ * is as dangerous as a crafted library. Images are large, 15 to 30 times
+ * the size of their input depending on its shape.
+ *
+ * With 'options->expand' a file included many times is parsed once and
+ * every include points to the same subtree, so a few small files
+ * including each other twice over describe a tree far too large to
+ * walk. Every include after the first counts the nodes of the tree it
+ * expands to against 'options->max_nodes' and 'options->max_expansion',
+ * which keeps freezing, diffing or copying the document as cheap as
+ * walking a document of that many nodes.
+ *
+ * With 'options->pipeline' a file is read by a thread of its own,
+ * CYAML_PIPELINE_CHUNK bytes at a time, while the calling thread parses
+ * what has arrived, so a large file takes about as long as the longer
+ * of reading and parsing it. This needs CYAML_THREADS and Linux, files
+ * are read before they are parsed otherwise.
+ */
+CYAMLDEF cyaml_t *
+cyaml_parse_opts(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options)
+{
+	cyaml_options_t resolved;
+	cyaml_arena_t arena;
+	if (s == NULL || n <= 0) {
+		return NULL;
+	}
+
+	cyaml_options_resolve(&resolved, options);
+#ifdef CYAML_HAVE_MMAP
+	if (resolved.cache && !resolved.buffer && !resolved.expand) {
+		return cyaml_cache_parse(s, n, loc, &resolved);
+	}
+#endif /* CYAML_HAVE_MMAP */
+	cyaml_arena_init(&arena, resolved.buffer, resolved.buffer_size);
+	arena.pages = resolved.pages;
+	return cyaml_parse_arena(&arena, s, n, loc, &resolved);
+}
+
+/**
+ * Returns the size of the buffer 'cyaml_parse_opts' needs to parse the
+ * document with 'options', or 0 if it does not parse. The buffer must
+ * be aligned to CYAML_ALIGN bytes to get by with exactly this size.
+ */
+CYAMLDEF size_t
+cyaml_parse_size(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options)
+{
+	cyaml_options_t resolved;
+	cyaml_arena_t arena;
+	cyaml_t *storage;
+	void *buffer;
+	size_t size;
+	if (s == NULL || n <= 0) {
+		return 0;
+	}
+
+	cyaml_options_resolve(&resolved, options);
+	size = (loc == CYAML_LOC_DISK ? 1 << 16 : n * 4) + 4096;
+	for (;;) {
+		buffer = CYAML_MALLOC(size);
+		if (!buffer) {
+			cyaml_log_message("Ran out of memory!");
+			return 0;
+		}
+
+		cyaml_arena_init(&arena, buffer, size);
+		storage = cyaml_parse_arena(&arena, s, n, loc, &resolved);
+		CYAML_FREE(buffer);
+		if (storage) {
+			return arena.peak;
+		}
+
+		/* anything but the buffer running out is a real error */
+		if (!arena.needed || size > SIZE_MAX / 2) {
+			return 0;
+		}
+		cyaml_error_pop();
+		size *= 2;
+	}
+}
+
+/**
+ * A document loaded a step at a time, its text handed over by the
+ * caller as it arrives and then parsed CYAML_LOAD_STEP bytes at a time.
+ * The text is kept on the top of 'arena' and grows like the parser's
+ * stacks do, the parse then running from 'parser' as it would for
+ * 'cyaml_parse_opts'.
+ */
+struct cyaml_load_t {
+	cyaml_arena_t arena;
+	cyaml_parser_t parser;
+	cyaml_share_t share;
+	cyaml_include_t *includes;
+	cyaml_doc_t *doc;
+	cyaml_t *root;
+	char *buffer;
+	size_t size;
+	size_t capacity;
+	size_t top;
+	enum cyaml_status status; /* CYAML_AGAIN until the document is parsed or failed */
+	int parsing;
+};
+
+/**
+ * @Internal: Gives back everything 'load' took, its document included.
+ */
+static void
+cyaml_load_fail(cyaml_load_t *load)
+{
+	if (load->status != CYAML_AGAIN) {
+		return;
+	}
+
+	load->status = CYAML_FAILED;
+	if (load->parsing) {
+		cyaml_parse_end(&load->parser, load->doc, NULL, load->buffer, load->capacity, load->top);
+	} else {
+		cyaml_arena_pop(&load->arena, load->buffer, load->capacity);
+		cyaml_arena_release(&load->arena);
+	}
+}
+
+/**
+ * Starts loading a document with 'options' (see 'cyaml_parse_opts',
+ * bar the cache), for an event loop that does the reading itself: the
+ * text is put into 'cyaml_load_buffer' and handed over with
+ * 'cyaml_load_commit', or read from a non-blocking descriptor with
+ * 'cyaml_load_read', and then parsed with 'cyaml_load_step'. Neither
+ * ever blocks or works on more than CYAML_LOAD_STEP bytes at once.
+ */
+CYAMLDEF cyaml_load_t *
+cyaml_load_create(cyaml_options_t *options)
+{
+	cyaml_options_t resolved;
+	cyaml_load_t *load;
+	load = CYAML_MALLOC(sizeof(*load));
+	if (!load) {
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
+	}
+
+	cyaml_options_resolve(&resolved, options);
+	cyaml_arena_init(&load->arena, resolved.buffer, resolved.buffer_size);
+	load->arena.pages = resolved.pages;
+	load->top = load->arena.top;
+	cyaml_parser_init(&load->parser, &load->arena, &resolved, &load->share, &load->includes);
+	load->includes = NULL;
+	load->root = NULL;
+	load->size = 0;
+	load->capacity = CYAML_LOAD_STEP;
+	load->status = CYAML_AGAIN;
+	load->parsing = 0;
+
+	load->doc = cyaml_arena_calloc(&load->arena, sizeof(*load->doc));
+	load->buffer = load->doc ? cyaml_arena_push(&load->arena, load->capacity) : NULL;
+	if (!load->buffer) {
+		cyaml_arena_release(&load->arena);
+		CYAML_FREE(load);
+		return NULL;
+	}
+	return load;
+}
+
+/**
+ * Returns where the next bytes of the document go and in '*size' how
+ * many fit there (at least CYAML_LOAD_STEP / 2), for instance for a
+ * read submitted to an io_uring. NULL once the whole document was
+ * committed or the load failed.
+ */
+CYAMLDEF char *
+cyaml_load_buffer(cyaml_load_t *load, size_t *size)
+{
+	char *grown;
+	if (!load || load->status != CYAML_AGAIN || load->parsing) {
+		return NULL;
+	}
+
+	/* a byte is kept for the nul the tokenizer stops at, and without a
+	 * buffer of the caller's the text is on the heap, where large blocks
+	 * grow without being copied */
+	if (load->capacity - load->size - 1 < CYAML_LOAD_STEP / 2) {
+		if (CYAML_ARENA_FIXEDP(&load->arena)) {
+			grown = cyaml_stack_grow(&load->arena, load->buffer, &load->capacity, 1, NULL);
+		} else {
+			grown = load->capacity <= SIZE_MAX / 2
+				? CYAML_REALLOC(load->buffer, 2 * load->capacity) : NULL;
+			if (!grown) {
+				cyaml_log_message("Ran out of memory!");
+			}
+			load->capacity *= grown ? 2 : 1;
+		}
+
+		if (!grown) {
+			cyaml_load_fail(load);
+			return NULL;
+		}
+		load->buffer = grown;
+	}
+
+	*size = load->capacity - load->size - 1;
+	return load->buffer + load->size;
+}
+
+/**
+ * Adds the 'n' bytes put into 'cyaml_load_buffer' to the document, 0
+ * meaning that the document ends there and can be parsed. Returns 0 if
+ * the load failed.
+ */
+CYAMLDEF int
+cyaml_load_commit(cyaml_load_t *load, size_t n)
+{
+	if (!load || load->status != CYAML_AGAIN || load->parsing) {
+		return 0;
+	}
+
+	if (n > load->capacity - load->size - 1) {
+		cyaml_log_message("Committed more than the buffer holds!");
+		cyaml_load_fail(load);
+		return 0;
+	}
+
+	/* the tokenizer stops at the first nul, so it must not cut the
+	 * document short */
+	if (memchr(load->buffer + load->size, '\0', n)) {
+		cyaml_log_message("Unexpected nul byte!");
+		cyaml_load_fail(load);
+		return 0;
+	}
+
+	load->size += n;
+	if (load->size > load->parser.options.max_bytes) {
+		cyaml_log_message("Document is larger than %zu bytes!", load->parser.options.max_bytes);
+		cyaml_load_fail(load);
+		return 0;
+	}
+
+	if (n == 0) {
+		if (load->size == 0) {
+			cyaml_log_message("File was empty!");
+			cyaml_load_fail(load);
+			return 0;
+		}
+		load->buffer[load->size] = '\0';
+		cyaml_parser_start(&load->parser, load->buffer);
+		load->parsing = 1;
+	}
+	return 1;
+}
+
+/**
+ * Reads what the non-blocking descriptor 'fd' has to offer into the
+ * document, up to CYAML_LOAD_STEP bytes. Returns CYAML_AGAIN when 'fd'
+ * would block or the step is used up, so with edge-triggered readiness
+ * the caller should call again without waiting, and CYAML_DONE once
+ * the whole document was read. Needs Linux, fails elsewhere.
+ */
+CYAMLDEF enum cyaml_status
+cyaml_load_read(cyaml_load_t *load, int fd)
+{
+#ifdef __linux__
+	size_t room, total = 0;
+	ssize_t nread;
+	char *buffer;
+	while (total < CYAML_LOAD_STEP) {
+		buffer = cyaml_load_buffer(load, &room);
+		if (!buffer) {
+			return load && load->parsing ? CYAML_DONE : CYAML_FAILED;
+		}
+
+		nread = read(fd, buffer, room);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		} else if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return CYAML_AGAIN;
+		} else if (nread < 0) {
+			cyaml_log_message("Failed to read file!");
+			cyaml_load_fail(load);
+			return CYAML_FAILED;
+		}
+
+		if (!cyaml_load_commit(load, (size_t) nread)) {
+			return CYAML_FAILED;
+		} else if (nread == 0) {
+			return CYAML_DONE;
+		}
+		total += (size_t) nread;
+	}
+	return CYAML_AGAIN;
+#else /* !defined(__linux__) */
+	(void) fd;
+	cyaml_log_message("Reading a descriptor is not supported!");
+	if (load) {
+		cyaml_load_fail(load);
+	}
+	return CYAML_FAILED;
+#endif /* __linux__ */
+}
+
+/**
+ * @Internal: Parses about 'budget' bytes of the document of 'load'.
+ */
+static enum cyaml_status
+cyaml_load_run(cyaml_load_t *load, size_t budget)
+{
+	enum cyaml_status status;
+	size_t until;
+	if (!load->parsing || load->status != CYAML_AGAIN) {
+		return load->status;
+	}
+
+	until = (size_t) (load->parser.lexer.cursor - load->parser.lexer.base);
+	until = until > SIZE_MAX - budget ? SIZE_MAX : until + budget;
+	status = cyaml_parse_run(&load->parser, until);
+	if (status == CYAML_FAILED) {
+		cyaml_load_fail(load);
+	} else if (status == CYAML_DONE) {
+		load->root = cyaml_parse_end(&load->parser, load->doc, load->parser.value,
+					     load->buffer, load->capacity, load->top);
+		load->status = CYAML_DONE;
+	}
+	return status;
+}
+
+/**
+ * Parses the next CYAML_LOAD_STEP bytes or so of a document that was
+ * committed in whole. Returns CYAML_AGAIN until the document is parsed
+ * (or while it is still being read), then CYAML_DONE, after which
+ * 'cyaml_load_finish' returns it.
+ */
+CYAMLDEF enum cyaml_status
+cyaml_load_step(cyaml_load_t *load)
+{
+	if (!load) {
+		return CYAML_FAILED;
+	}
+	return cyaml_load_run(load, CYAML_LOAD_STEP);
+}
+
+/**
+ * Frees 'load', returning the document it loaded. A load that has not
+ * returned CYAML_DONE from 'cyaml_load_step' yet is cancelled, and NULL
+ * returned.
+ */
+CYAMLDEF cyaml_t *
+cyaml_load_finish(cyaml_load_t *load)
+{
+	cyaml_t *root;
+	if (!load) {
+		return NULL;
+	}
+
+	cyaml_load_fail(load);
+	root = load->root;
+	CYAML_FREE(load);
+	return root;
+}
+
+/**
+ * A parse run a budget of input at a time, the document being loaded
+ * from 'text' or 'file' by 'load'. A file includes itself through
+ * 'self', as in 'cyaml_parse_arena'.
+ */
+struct cyaml_parse_t {
+	cyaml_load_t *load;
+	char *text;
+	size_t size;
+	size_t copied;
+	FILE *file;
+	cyaml_include_t self;
+};
+
+/**
+ * Starts a parse of the document 's' like 'cyaml_parse_opts' (bar the
+ * cache), which 'cyaml_parse_step' then carries out a budget of input
+ * at a time, so that a thread with other work to do can parse a large
+ * document in between. Memory is not copied or a file read any faster
+ * than it is parsed.
+ */
+CYAMLDEF cyaml_parse_t *
+cyaml_parse_begin(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options)
+{
+	cyaml_parse_t *parse;
+	if (s == NULL || n <= 0) {
+		return NULL;
+	}
+
+	parse = CYAML_CALLOC(1, sizeof(*parse) + (loc == CYAML_LOC_DISK ? n + 1 : 0));
+	if (!parse) {
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
+	}
+
+	parse->load = cyaml_load_create(options);
+	if (!parse->load) {
+		CYAML_FREE(parse);
+		return NULL;
+	}
+
+	if (loc == CYAML_LOC_MEMORY) {
+		parse->text = s;
+		parse->size = n;
+		return parse;
+	}
+
+	/* the document is being parsed, so including it is a cycle */
+	parse->self.path = (char *) (parse + 1);
+	memcpy(parse->self.path, s, n);
+	parse->load->parser.path = parse->self.path;
+	parse->load->parser.path_len = n;
+	parse->load->includes = &parse->self;
+	cyaml_include_identify(&parse->self);
+	if (!cyaml_file_regular(parse->self.path)) {
+		cyaml_load_finish(parse->load);
+		CYAML_FREE(parse);
+		return NULL;
+	}
+
+	parse->file = fopen(parse->self.path, "r");
+	if (!parse->file) {
+		cyaml_log_message("Failed to open file!");
+		cyaml_load_finish(parse->load);
+		CYAML_FREE(parse);
+		return NULL;
+	}
+	return parse;
+}
+
+/**
+ * Advances 'parse' by about 'budget' bytes of input, reading or copying
+ * the document first and then parsing it. Returns CYAML_AGAIN until the
+ * document is parsed, then CYAML_DONE, after which 'cyaml_parse_finish'
+ * returns it.
+ */
+CYAMLDEF enum cyaml_status
+cyaml_parse_step(cyaml_parse_t *parse, size_t budget)
+{
+	cyaml_load_t *load;
+	size_t room, n;
+	char *buffer;
+	if (!parse) {
+		return CYAML_FAILED;
+	}
+
+	load = parse->load;
+	budget = budget ? budget : 1;
+	while (!load->parsing && load->status == CYAML_AGAIN) {
+		if (budget == 0) {
+			return CYAML_AGAIN;
+		}
+
+		buffer = cyaml_load_buffer(load, &room);
+		if (!buffer) {
+			return CYAML_FAILED;
+		}
+
+		n = room < budget ? room : budget;
+		if (parse->file) {
+			n = fread(buffer, 1, n, parse->file);
+			if (n == 0 && ferror(parse->file)) {
+				cyaml_log_message("Failed to read file!");
+				cyaml_load_fail(load);
+				return CYAML_FAILED;
+			}
+		} else {
+			n = n < parse->size - parse->copied ? n : parse->size - parse->copied;
+			memcpy(buffer, parse->text + parse->copied, n);
+			parse->copied += n;
+		}
+
+		if (!cyaml_load_commit(load, n)) {
+			return CYAML_FAILED;
+		}
+		budget -= n;
+	}
+	return cyaml_load_run(load, budget);
+}
+
+/**
+ * Frees 'parse', returning the document it parsed. A parse that has not
+ * returned CYAML_DONE from 'cyaml_parse_step' yet is cancelled, and NULL
+ * returned.
+ */
+CYAMLDEF cyaml_t *
+cyaml_parse_finish(cyaml_parse_t *parse)
+{
+	cyaml_t *root;
+	if (!parse) {
+		return NULL;
+	}
+
+	root = cyaml_load_finish(parse->load);
+	if (parse->file) {
+		fclose(parse->file);
+	}
+	CYAML_FREE(parse);
+	return root;
+}
+
+/**
+ * @Internal: Fills in where 'cyaml_validate' stopped, at 'at' in 's'.
+ */
+static int
+cyaml_validate_error(cyaml_error_t *error, const char *message, char *s, char *at)
+{
+	char *line = s, *newline;
+	if (!error) {
+		return 0;
+	}
+
+	error->message = message;
+	error->line = 1;
+	while ((newline = memchr(line, '\n', (size_t) (at - line)))) {
+		line = newline + 1;
+		error->line++;
+	}
+	error->column = (size_t) (at - line) + 1;
+	return 0;
+}
+
+/**
+ * Checks that the nul-terminated document 's' of 'n' bytes parses,
+ * without building it or allocating any memory. The checks are those of
+ * 'cyaml_parse' with the default limits, except for duplicate keys,
+ * which take memory to find. Returns 1 if the document is valid,
+ * otherwise 0 with the reason in 'error' unless it is NULL.
+ *
+ * Like the parser it goes through the document in a single pass, with
+ * the kind of every open list and mapping in a stack of CYAML_MAX_DEPTH
+ * blocks and the indentation levels of the tokenizer in one of its own.
+ */
+CYAMLDEF int
+cyaml_validate(char *s, size_t n, cyaml_error_t *error)
+{
+	enum { CYAML_VALIDATE_NODE, CYAML_VALIDATE_ITEM, CYAML_VALIDATE_ENTRY, CYAML_VALIDATE_NEXT } state;
+	enum { CYAML_VALIDATE_LIST = 1, CYAML_VALIDATE_INDENTED = 2 };
+	size_t indents[CYAML_MAX_DEPTH + 2], depth = 0, key_len;
+	unsigned char blocks[CYAML_MAX_DEPTH], block;
+	cyaml_lexer_t lexer;
+	cyaml_token_t token, ptoken;
+	char *nul;
+	const char *message = NULL;
+	int indented = 0;
+	if (!s) {
+		return cyaml_validate_error(error, "No document!", "", "");
+	}
+
+	nul = memchr(s, '\0', n);
+	if (nul) {
+		return cyaml_validate_error(error, "Unexpected nul byte!", s, nul);
+	}
+
+	/* a document nested deeply enough to fill the levels is turned down
+	 * for its depth before the tokenizer would need another */
+	cyaml_lexer_init(&lexer, s, NULL);
+	lexer.indents = indents;
+	lexer.indents[0] = 0;
+	lexer.capacity = CYAML_MAX_DEPTH + 2;
+	token = cyaml_token_get(&lexer);
+	if (CYAML_TOKEN_LINEP(token)) {
+		indented = CYAML_TOKEN_INDENTP(token);
+		token = cyaml_token_get(&lexer);
+	}
+
+	if (CYAML_TOKEN_ENDP(token)) {
+		return 1;
+	}
+
+	state = CYAML_VALIDATE_NODE;
+	while (!message) {
+		switch (state) {
+		case CYAML_VALIDATE_NODE:
+			if (CYAML_TOKEN_DASHP(token) || (CYAML_TOKEN_VALUEP(token)
+				&& CYAML_TOKEN_COLONP(cyaml_token_peek(&lexer, 0)))) {
+				if (depth == CYAML_MAX_DEPTH) {
+					message = "Document is nested too deeply!";
+					break;
+				}
+				blocks[depth++] = (CYAML_TOKEN_DASHP(token) ? CYAML_VALIDATE_LIST : 0)
+					| (indented ? CYAML_VALIDATE_INDENTED : 0);
+				state = CYAML_TOKEN_DASHP(token) ? CYAML_VALIDATE_ITEM : CYAML_VALIDATE_ENTRY;
+			} else if (CYAML_TOKEN_VALUEP(token)) {
+				token = cyaml_token_get(&lexer);
+				if (indented && !CYAML_TOKEN_UNDENTP(token)) {
+					message = cyaml_token_unexpected(token);
+					break;
+				} else if (indented) {
+					token = cyaml_token_get(&lexer);
+				}
+				state = CYAML_VALIDATE_NEXT;
+			} else {
+				message = cyaml_token_unexpected(token);
+			}
+			break;
+		case CYAML_VALIDATE_ITEM:
+			token = cyaml_token_get(&lexer);
+			state = CYAML_VALIDATE_NEXT;
+			if (CYAML_TOKEN_INDENTP(token)) {
+				indented = 1;
+				token = cyaml_token_get(&lexer);
+				state = CYAML_VALIDATE_NODE;
+			}
+			break;
+		case CYAML_VALIDATE_ENTRY:
+			key_len = token.len;
+			token = cyaml_token_get(&lexer);
+			if (!CYAML_TOKEN_COLONP(token)) {
+				message = "Expected ':' after key!";
+				break;
+			}
+
+			if (key_len == 0) {
+				message = "Empty key!";
+				break;
+			}
+
+			token = cyaml_token_get(&lexer);
+			state = CYAML_VALIDATE_NEXT;
+			if (CYAML_TOKEN_VALUEP(token)) {
+				if (CYAML_TOKEN_COLONP(cyaml_token_peek(&lexer, 0))) {
+					message = "Mappings must start on a new line!";
+					break;
+				}
+				token = cyaml_token_get(&lexer);
+			} else if (CYAML_TOKEN_INDENTP(token)) {
+				indented = 1;
+				token = cyaml_token_get(&lexer);
+				state = CYAML_VALIDATE_NODE;
+			} else if (token.type == CYAML_TOKEN_EMPTY
+				   && CYAML_TOKEN_DASHP(cyaml_token_peek(&lexer, 0))) {
+				/* a list at the level of the mapping is the value of the key */
+				indented = 0;
+				token = cyaml_token_get(&lexer);
+				state = CYAML_VALIDATE_NODE;
+			}
+			break;
+		case CYAML_VALIDATE_NEXT:
+			if (depth == 0) {
+				if (CYAML_TOKEN_ENDP(token)) {
+					return 1;
+				}
+				message = cyaml_token_unexpected(token);
+				break;
+			}
+
+			block = blocks[depth - 1];
+			if (token.type == CYAML_TOKEN_EMPTY) {
+				ptoken = cyaml_token_peek(&lexer, 0);
+				if (block & CYAML_VALIDATE_LIST ? CYAML_TOKEN_DASHP(ptoken) : CYAML_TOKEN_VALUEP(ptoken)) {
+					token = cyaml_token_get(&lexer);
+					state = block & CYAML_VALIDATE_LIST ? CYAML_VALIDATE_ITEM : CYAML_VALIDATE_ENTRY;
+					break;
+				}
+
+				if (block != CYAML_VALIDATE_LIST || depth == 1 || !CYAML_TOKEN_VALUEP(ptoken)) {
+					message = cyaml_token_unexpected(token);
+					break;
+				}
+			} else if (!CYAML_TOKEN_UNDENTP(token) && !CYAML_TOKEN_ENDP(token)) {
+				message = cyaml_token_unexpected(token);
+				break;
+			}
+
+			depth--;
+			if (block & CYAML_VALIDATE_INDENTED) {
+				token = cyaml_token_get(&lexer);
+			}
+			break;
+		}
+	}
+
+	return cyaml_validate_error(error, message, s, CYAML_TOKEN_ERRORP(token) ? lexer.cursor : token.data);
+}
+
+/**
+ * @Internal: A tokenizer of 'cyaml_tokenize', whose indentation levels
+ * grow on the heap.
+ */
+struct cyaml_tokenizer_t {
+	cyaml_arena_t arena;
+	cyaml_lexer_t lexer;
+};
+
+/**
+ * Creates a tokenizer of the nul-terminated document 's' of 'n' bytes,
+ * which must stay around as long as the tokenizer. Returns NULL if it
+ * contains a nul byte or memory runs out.
+ */
+CYAMLDEF cyaml_tokenizer_t *
+cyaml_tokenizer_create(char *s, size_t n)
+{
+	cyaml_tokenizer_t *tokenizer;
+	if (!s) {
+		return NULL;
+	}
+
+	if (memchr(s, '\0', n)) {
+		cyaml_log_message("Unexpected nul byte!");
+		return NULL;
+	}
+
+	tokenizer = CYAML_MALLOC(sizeof(*tokenizer));
+	if (!tokenizer) {
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
+	}
+
+	cyaml_arena_init(&tokenizer->arena, NULL, 0);
+	cyaml_lexer_init(&tokenizer->lexer, s, &tokenizer->arena);
+	return tokenizer;
+}
+
+/**
+ * Fills 'tokens' with up to 'cap' of the next tokens of the document,
+ * returning how many. It picks up where the previous call left off, so
+ * a document of any size can be tokenized through a small array. The
+ * last token is END, or ERROR with the reason logged, and after it 0 is
+ * returned. This is the tokenizer the parser runs on.
+ */
+CYAMLDEF size_t
+cyaml_tokenize(cyaml_tokenizer_t *tokenizer, cyaml_lexeme_t *tokens, size_t cap)
+{
+	size_t size;
+	if (!tokenizer || tokenizer->lexer.stopped) {
+		return 0;
+	}
+
+	size = cyaml_lexer_scan(&tokenizer->lexer, tokens, cap);
+	if (size && tokens[size - 1].type == CYAML_TOKEN_ERROR && *tokenizer->lexer.error) {
+		cyaml_log_message("%s", tokenizer->lexer.error);
+	}
+	return size;
+}
+
+/**
+ * Like 'cyaml_tokenize', but fills 'tokens' with packed tokens of 8
+ * bytes, twice as many of them per cache line. A token 4 GB or more
+ * into the document or 16 MB or longer cannot be packed and stops the
+ * tokenizer with an ERROR, the document is then left to
+ * 'cyaml_tokenize'.
+ */
+CYAMLDEF size_t
+cyaml_tokenize_packed(cyaml_tokenizer_t *tokenizer, cyaml_packed_t *tokens, size_t cap)
+{
+	cyaml_lexeme_t lexeme;
+	cyaml_lexer_t *lexer;
+	size_t i;
+	if (!tokenizer) {
+		return 0;
+	}
+
+	lexer = &tokenizer->lexer;
+	for (i = 0; i < cap && !lexer->stopped; i++) {
+		cyaml_lexer_next(lexer, &lexeme);
+		if (lexeme.type != CYAML_TOKEN_ERROR && !cyaml_lexer_pack(&lexeme, &tokens[i])) {
+			lexer->error = "Token does not fit in a packed token!";
+			lexer->stopped = 1;
+			lexeme.type = CYAML_TOKEN_ERROR;
+			lexeme.len = 0;
+		}
+
+		if (lexeme.type == CYAML_TOKEN_ERROR) {
+			tokens[i].offset = lexeme.offset < UINT32_MAX ? (uint32_t) lexeme.offset : UINT32_MAX;
+			tokens[i].info = CYAML_TOKEN_ERROR;
+			if (*lexer->error) {
+				cyaml_log_message("%s", lexer->error);
+			}
+		}
+	}
+	return i;
+}
+
+CYAMLDEF void
+cyaml_tokenizer_free(cyaml_tokenizer_t *tokenizer)
+{
+	if (tokenizer) {
+		cyaml_lexer_free(&tokenizer->lexer);
+		CYAML_FREE(tokenizer);
+	}
+}
+
+/**
+ * @Internal: Resolves 'path' relative to 'cyaml'. Keys may themselves
+ * contain dots, so every key of the mapping that is a prefix of the
+ * path and ends at a separator is tried, shortest first.
+ */
+static cyaml_t *
+cyaml_lookup_path(cyaml_t *cyaml, char *path)
+{
+	cyaml_trie_t *trie;
+	cyaml_t *result;
+	size_t i;
+	if (*path == '\0') {
+		return cyaml;
+	}
+
+	if (*path == '[') {
+		char *end;
+		size_t index = strtoul(path + 1, &end, 10);
+		if (end == path + 1 || *end != ']') {
+			cyaml_log_message("Invalid index in path!");
+			return NULL;
+		}
+
+		if (cyaml->type != CYAML_STORAGE_LIST || index >= cyaml->size) {
+			return NULL;
+		}
+
+		path = end + 1;
+		if (*path == '.') {
+			path++;
+		}
+		return cyaml_lookup_path(cyaml->storage.items[index], path);
+	}
+
+	if (cyaml->type != CYAML_STORAGE_MAPPING) {
+		return NULL;
+	}
+
+	if (CYAML_LOAD_ACQUIRE(cyaml->perfect)) {
+		cyaml_dict_t *entry;
+		for (i = strcspn(path, ".["); ; i += 1 + strcspn(path + i + 1, ".[")) {
+			entry = cyaml_phash_find(cyaml, path, i);
+			if (entry && (result = cyaml_lookup_path(entry->value, path + i + (path[i] == '.')))) {
+				return result;
+			}
+
+			if (path[i] == '\0') {
+				return NULL;
+			}
+		}
+	}
+
+	trie = cyaml->index;
+	for (i = 0; trie && path[i] != '\0'; ) {
+		unsigned char c = path[i], character = trie->character;
+		if (c < character) {
+			trie = trie->left;
+		} else if (c > character) {
+			trie = trie->right;
+		} else {
+			i++;
+			if (trie->index && (path[i] == '\0' || path[i] == '.' || path[i] == '[')) {
+				result = cyaml->storage.data[trie->index - 1].value;
+				result = cyaml_lookup_path(result, path + i + (path[i] == '.'));
+				if (result) {
+					return result;
+				}
+			}
+			trie = trie->children;
+		}
+	}
+	return NULL;
+}
+
+#if CYAML_LOOKUP_CACHE
+/**
+ * @Internal: A lookup remembered by the thread that made it, the node
+ * found at 'path' from the root 'cyaml' of the document stamped 'stamp'.
+ */
+typedef struct cyaml_lookup_entry_t {
+	uint64_t stamp;
+	uint64_t hash;
+	cyaml_t *cyaml;
+	cyaml_t *result;
+	char path[CYAML_LOOKUP_CACHE_PATH];
+} cyaml_lookup_entry_t;
+
+static CYAML_THREAD_LOCAL cyaml_lookup_entry_t cyaml_lookup_cache[CYAML_LOOKUP_CACHE];
+#endif /* CYAML_LOOKUP_CACHE */
+
+/**
+ * Returns the node at 'path' below 'cyaml', or NULL if there is none.
+ * Lookups only read the document, without locks or waiting, so a
+ * document may be looked up from any number of threads at once.
+ *
+ * With CYAML_LOOKUP_CACHE every thread remembers that many of its
+ * recent lookups from the root of a document, in memory no other
+ * thread touches. They are only ever answered for that very document,
+ * not for a later one at the same address.
+ */
+CYAMLDEF cyaml_t *
+cyaml_lookup(cyaml_t *cyaml, char *path)
+{
+#if CYAML_LOOKUP_CACHE
+	cyaml_lookup_entry_t *entry;
+	uint64_t stamp, hash;
+	size_t len;
+#endif /* CYAML_LOOKUP_CACHE */
+	if (!cyaml || !path) {
+		return NULL;
+	}
+
+#if CYAML_LOOKUP_CACHE
+	len = strlen(path);
+	if (len >= CYAML_LOOKUP_CACHE_PATH || !cyaml->root) {
+		return cyaml_lookup_path(cyaml, path);
+	}
+
+	stamp = CYAML_DOC(cyaml)->stamp;
+	hash = cyaml_hash(path, len, stamp);
+	entry = &cyaml_lookup_cache[hash & (CYAML_LOOKUP_CACHE - 1)];
+	if (entry->stamp == stamp && entry->hash == hash && entry->cyaml == cyaml
+	    && memcmp(entry->path, path, len + 1) == 0) {
+		return entry->result;
+	}
+
+	entry->result = cyaml_lookup_path(cyaml, path);
+	if (entry->result) {
+		entry->stamp = stamp;
+		entry->hash = hash;
+		entry->cyaml = cyaml;
+		memcpy(entry->path, path, len + 1);
+	} else {
+		entry->stamp = 0;
+	}
+	return entry->result;
+#else /* !CYAML_LOOKUP_CACHE */
+	return cyaml_lookup_path(cyaml, path);
+#endif /* CYAML_LOOKUP_CACHE */
+}
+
+/**
+ * @Internal: Walks the keys of the trie in order, a key ending at a
+ * node being smaller than the keys continuing into its children.
+ */
+static int
+cyaml_trie_foreach(cyaml_t *mapping, cyaml_trie_t *trie, cyaml_foreach_fn fn, void *data)
+{
+	int result;
+	while (trie) {
+		if ((result = cyaml_trie_foreach(mapping, trie->left, fn, data))) {
+			return result;
+		}
+
+		if (trie->index && (result = fn(mapping->storage.data + trie->index - 1, data))) {
+			return result;
+		}
+
+		if ((result = cyaml_trie_foreach(mapping, trie->children, fn, data))) {
+			return result;
+		}
+		trie = trie->right;
+	}
+	return 0;
+}
+
+CYAMLDEF int
+cyaml_foreach_prefix(cyaml_t *cyaml, char *prefix, cyaml_foreach_fn fn, void *data)
+{
+	cyaml_trie_t *trie;
+	size_t len;
+	int result;
+	if (!cyaml || !fn || cyaml->type != CYAML_STORAGE_MAPPING) {
+		return 0;
+	}
+
+	len = prefix ? strlen(prefix) : 0;
+	if (len == 0) {
+		return cyaml_trie_foreach(cyaml, cyaml->index, fn, data);
+	}
+
+	trie = cyaml_trie_find(cyaml->index, prefix, len);
+	if (!trie) {
+		return 0;
+	}
+
+	if (trie->index && (result = fn(cyaml->storage.data + trie->index - 1, data))) {
+		return result;
+	}
+	return cyaml_trie_foreach(cyaml, trie->children, fn, data);
+}
+
+/**
+ * @Internal: The bounds of a range walk, the walk is 'tight' against a
+ * bound while the key walked so far is equal to the start of the bound,
+ * subtrees that fall entirely outside of the bounds are never entered.
+ */
+typedef struct cyaml_range_t {
+	unsigned char *first, *last;
+	size_t first_len, last_len;
+	cyaml_foreach_fn fn;
+	void *data;
+} cyaml_range_t;
+
+static int
+cyaml_trie_range(cyaml_t *mapping, cyaml_trie_t *trie, cyaml_range_t *range,
+		 size_t depth, int first_tight, int last_tight)
+{
+	int result, node_first_tight, node_last_tight;
+	unsigned char character;
+	if (first_tight && depth >= range->first_len) {
+		first_tight = 0;
+	}
+
+	if (last_tight && depth >= range->last_len) {
+		return 0;
+	}
+
+	while (trie) {
+		character = trie->character;
+		if (!(first_tight && character <= range->first[depth])) {
+			result = cyaml_trie_range(mapping, trie->left, range, depth,
+						  first_tight, last_tight);
+			if (result) {
+				return result;
+			}
+		}
+
+		if (last_tight && character > range->last[depth]) {
+			return 0;
+		}
+
+		if (!(first_tight && character < range->first[depth])) {
+			node_first_tight = first_tight && character == range->first[depth];
+			node_last_tight = last_tight && character == range->last[depth];
+			if (trie->index
+			    && (!node_first_tight || depth + 1 == range->first_len)
+			    && (!node_last_tight || depth + 1 < range->last_len)) {
+				result = range->fn(mapping->storage.data + trie->index - 1, range->data);
+				if (result) {
+					return result;
+				}
+			}
+
+			result = cyaml_trie_range(mapping, trie->children, range, depth + 1,
+						  node_first_tight, node_last_tight);
+			if (result) {
+				return result;
+			}
+		}
+
+		if (last_tight && character == range->last[depth]) {
+			return 0;
+		}
+		trie = trie->right;
+	}
+	return 0;
+}
+
+/**
+ * Calls 'fn' for every key of the mapping 'cyaml' that is within
+ * ['first', 'last'), a NULL bound leaves that side of the range open.
+ */
+CYAMLDEF int
+cyaml_foreach_range(cyaml_t *cyaml, char *first, char *last, cyaml_foreach_fn fn, void *data)
+{
+	cyaml_range_t range;
+	if (!cyaml || !fn || cyaml->type != CYAML_STORAGE_MAPPING) {
+		return 0;
+	}
+
+	range.first = (unsigned char *) first;
+	range.first_len = first ? strlen(first) : 0;
+	range.last = (unsigned char *) last;
+	range.last_len = last ? strlen(last) : 0;
+	range.fn = fn;
+	range.data = data;
+	return cyaml_trie_range(cyaml, cyaml->index, &range, 0, first != NULL, last != NULL);
+}
+
+/**
+ * Builds a minimal perfect hash over the keys of every mapping of at
+ * least CYAML_FREEZE_THRESHOLD keys in the document, which lookups use
+ * from then on instead of the trie. The document must not be changed
+ * afterwards. Returns 0 if some mapping could not be frozen, in which
+ * case that mapping keeps being looked up through its trie.
+ *
+ * With CYAML_THREADS a document may be frozen while other threads are
+ * reading it, each hash being published once it is complete, but only
+ * by one thread at a time.
+ *
+ * 'cyaml' must be the root returned by 'cyaml_parse', the hashes are
+ * allocated from the same memory as the document.
+ */
+static int
+cyaml_freeze_node(cyaml_arena_t *arena, cyaml_t *cyaml)
+{
+	cyaml_phash_t *perfect = NULL;
+	uint64_t seed;
+	size_t i;
+	int frozen = 1;
+	switch (cyaml->type) {
+	case CYAML_STORAGE_SCALAR:
+		break;
+	case CYAML_STORAGE_LIST:
+		for (i = 0; i < cyaml->size; i++) {
+			frozen &= cyaml_freeze_node(arena, cyaml->storage.items[i]);
+		}
+		break;
+	case CYAML_STORAGE_MAPPING:
+		if (!cyaml->perfect && cyaml->size >= CYAML_FREEZE_THRESHOLD
+		    && cyaml->size < CYAML_PHASH_DIRECT) {
+			for (seed = 0; !perfect && seed < 4; seed++) {
+				perfect = cyaml_phash_build(arena, cyaml, cyaml_hash_mix(seed + 1));
+			}
+			if (perfect) {
+				CYAML_STORE_RELEASE(cyaml->perfect, perfect);
+			}
+			frozen = perfect != NULL;
+		}
+
+		for (i = 0; i < cyaml->size; i++) {
+			frozen &= cyaml_freeze_node(arena, cyaml->storage.data[i].value);
+		}
+		break;
+	}
+	return frozen;
+}
+
+CYAMLDEF int
+cyaml_freeze(cyaml_t *cyaml)
+{
+	if (!cyaml) {
+		return 0;
+	}
+	return cyaml_freeze_node(&CYAML_DOC(cyaml)->arena, cyaml);
+}
+
+CYAMLDEF void
+cyaml_free(cyaml_t *cyaml)
+{
+	cyaml_arena_t arena;
+	if (!cyaml) {
+		return;
+	}
+
+	/* the document lives in one of its own chunks, documents living in
+	 * a caller's buffer have none and are simply dropped */
+	arena = CYAML_DOC(cyaml)->arena;
+	cyaml_arena_release(&arena);
+}
+
+#ifdef CYAML_HAVE_MMAP
+/**
+ * @Internal: Copies 'cyaml' into 'arena', rebuilding the index of every
+ * mapping in the new memory. Equal subtrees are stored once again if
+ * 'share' is not NULL.
+ */
+static cyaml_t *
+cyaml_copy(cyaml_arena_t *arena, cyaml_t *cyaml, cyaml_share_t *share)
+{
+	cyaml_t *copy, *item;
+	cyaml_dict_t *entry;
+	cyaml_mark_t mark;
+	size_t i;
+	cyaml_arena_mark(arena, &mark);
+	if (cyaml->type == CYAML_STORAGE_SCALAR) {
+		copy = cyaml_scalar_create(arena, cyaml->storage.scalar, cyaml->size);
+		if (!copy) {
+			return NULL;
+		}
+		copy->hash = cyaml->hash;
+		copy->hash_high = cyaml->hash_high;
+		return share ? cyaml_share(share, arena, copy, &mark) : copy;
+	}
+
+	copy = cyaml_create(arena, cyaml->type);
+	if (!copy) {
+		return NULL;
+	}
+	copy->hash = cyaml->hash;
+	copy->hash_high = cyaml->hash_high;
+
+	for (i = 0; i < cyaml->size; i++) {
+		if (cyaml->type == CYAML_STORAGE_LIST) {
+			item = cyaml_copy(arena, cyaml->storage.items[i], share);
+			if (!item || !cyaml_list_append(arena, copy, item)) {
+				return NULL;
+			}
+		} else {
+			entry = cyaml->storage.data + i;
+			item = cyaml_copy(arena, entry->value, share);
+			if (!item || !cyaml_mapping_insert(arena, copy, entry->key, entry->len, item)) {
+				return NULL;
+			}
+			copy->storage.data[i].hash = entry->hash;
+		}
+	}
+	if (!cyaml_hash_finish(arena, copy, copy->hash ? CYAML_HASH_64 : CYAML_HASH_NONE)) {
+		return NULL;
+	}
+	return share ? cyaml_share(share, arena, copy, &mark) : copy;
+}
+
+/**
+ * @Internal: Copies the document 'cyaml' into 'doc', allocated from
+ * 'arena', and freezes the copy.
+ */
+static int
+cyaml_copy_doc(cyaml_arena_t *arena, cyaml_doc_t *doc, cyaml_t *cyaml)
+{
+	cyaml_share_t share;
+	cyaml_t *copy;
+	memset(&share, 0, sizeof(share));
+	doc->shared = CYAML_DOC(cyaml)->shared;
+	copy = cyaml_copy(arena, cyaml, doc->shared ? &share : NULL);
+	cyaml_arena_pop(arena, share.nodes, share.capacity * sizeof(*share.nodes));
+	if (!copy) {
+		return 0;
+	}
+
+	doc->root = *copy;
+	doc->root.root = 1;
+	CYAML_STAMP(doc);
+	cyaml_freeze_node(arena, &doc->root);
+	return 1;
+}
+#endif /* CYAML_HAVE_MMAP */
+
+/**
+ * Returns a frozen copy of 'cyaml' whose memory is bound to the NUMA
+ * node 'node' and backed with the same kind of pages as 'cyaml'. Threads
+ * running on that node (see 'cyaml_numa_node') then look keys up in
+ * local memory. Needs Linux, fails elsewhere.
+ */
+CYAMLDEF cyaml_t *
+cyaml_replicate(cyaml_t *cyaml, int node)
+{
+#ifdef CYAML_HAVE_MMAP
+	cyaml_arena_t arena;
+	cyaml_doc_t *doc;
+	if (!cyaml || node < 0) {
+		return NULL;
+	}
+
+	cyaml_arena_init(&arena, NULL, 0);
+	arena.pages = CYAML_DOC(cyaml)->arena.pages;
+	arena.node = node;
+	doc = cyaml_arena_calloc(&arena, sizeof(*doc));
+	if (!doc || !cyaml_copy_doc(&arena, doc, cyaml)) {
+		cyaml_arena_release(&arena);
+		return NULL;
+	}
+	doc->arena = arena;
+	return &doc->root;
+#else /* !defined(CYAML_HAVE_MMAP) */
+	(void) cyaml;
+	(void) node;
+	cyaml_log_message("NUMA replication is not supported!");
+	return NULL;
+#endif /* CYAML_HAVE_MMAP */
+}
+
+#ifdef CYAML_HAVE_MMAP
+#ifdef MAP_FIXED_NOREPLACE
+#define CYAML_MAP_NOREPLACE MAP_FIXED_NOREPLACE
+#else /* !defined(MAP_FIXED_NOREPLACE) */
+#define CYAML_MAP_NOREPLACE (0)
+#endif /* MAP_FIXED_NOREPLACE */
+
+#define CYAML_CACHE_MAGIC (0x31306863616d7963ULL) /* "cyamch01" */
+
+/**
+ * @Internal: The header of an image in the parse cache. An image is a
+ * single chunk holding this header, the frozen document and the
+ * offsets of every pointer in it, which are adjusted when the image
+ * cannot be mapped at the address it was built at. The pointers are
+ * used as they are, so images are trusted, see 'cyaml_parse_opts'.
+ */
+typedef struct cyaml_cache_t {
+	uint64_t magic;
+	uint64_t key;
+	uint64_t key_high;
+	uint64_t base;
+	uint64_t size;
+	uint64_t doc;
+	uint64_t relocs;
+	uint64_t relocations;
+} cyaml_cache_t;
+
+typedef struct cyaml_cache_slots_t {
+	char *image;
+	uint64_t *offsets;
+	size_t size;
+	size_t capacity;
+} cyaml_cache_slots_t;
+
+/**
+ * @Internal: Hashes the input together with the options that change
+ * what parsing it results in.
+ */
+static uint64_t
+cyaml_cache_key(char *buffer, size_t size, cyaml_options_t *options, uint64_t *high)
+{
+	uint64_t params[7];
+	params[0] = CYAML_CACHE_MAGIC;
+	params[1] = options->max_depth;
+	params[2] = options->max_bytes;
+	params[3] = options->max_nodes;
+	params[4] = options->max_scalar;
+	params[5] = options->hash;
+	params[6] = options->share;
+	return cyaml_hash_wide(buffer, size, cyaml_hash((char *) params, sizeof(params), 0), high);
+}
+
+static int
+cyaml_cache_slot(cyaml_cache_slots_t *slots, void *slot)
+{
+	void *pointer, *offsets;
+	size_t capacity;
+	memcpy(&pointer, slot, sizeof(pointer));
+	if (!pointer) {
+		return 1;
+	}
+
+	if (slots->size == slots->capacity) {
+		capacity = slots->capacity ? slots->capacity * 2 : 256;
+		offsets = CYAML_REALLOC(slots->offsets, capacity * sizeof(*slots->offsets));
+		if (!offsets) {
+			return 0;
+		}
+		slots->offsets = offsets;
+		slots->capacity = capacity;
+	}
+	slots->offsets[slots->size++] = (uint64_t) ((char *) slot - slots->image);
+	return 1;
+}
+
+static int
+cyaml_cache_trie(cyaml_cache_slots_t *slots, cyaml_trie_t *trie)
+{
+	for (; trie; trie = trie->right) {
+		if (!cyaml_cache_slot(slots, &trie->left) || !cyaml_cache_slot(slots, &trie->children)
+		    || !cyaml_cache_slot(slots, &trie->right)
+		    || !cyaml_cache_trie(slots, trie->left) || !cyaml_cache_trie(slots, trie->children)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @Internal: Collects the offsets of the pointers in 'cyaml' and
+ * everything below it.
+ */
+static int
+cyaml_cache_node(cyaml_cache_slots_t *slots, cyaml_t *cyaml)
+{
+	size_t i;
+	if (!cyaml_cache_slot(slots, &cyaml->storage) || !cyaml_cache_slot(slots, &cyaml->index)
+	    || !cyaml_cache_slot(slots, &cyaml->perfect) || !cyaml_cache_slot(slots, &cyaml->blocks)
+	    || !cyaml_cache_trie(slots, cyaml->index)) {
+		return 0;
+	}
+
+	if (cyaml->perfect && (!cyaml_cache_slot(slots, &cyaml->perfect->displacements)
+			       || !cyaml_cache_slot(slots, &cyaml->perfect->slots))) {
+		return 0;
+	}
+
+	for (i = 0; i < cyaml->size; i++) {
+		if (cyaml->type == CYAML_STORAGE_LIST) {
+			if (!cyaml_cache_slot(slots, cyaml->storage.items + i)
+			    || !cyaml_cache_node(slots, cyaml->storage.items[i])) {
+				return 0;
+			}
+		} else if (cyaml->type == CYAML_STORAGE_MAPPING) {
+			if (!cyaml_cache_slot(slots, &cyaml->storage.data[i].key)
+			    || !cyaml_cache_slot(slots, &cyaml->storage.data[i].value)
+			    || !cyaml_cache_node(slots, cyaml->storage.data[i].value)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int
+cyaml_cache_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @Internal: Maps the image at 'path' if it was built for the input
+ * hashing to 'key', preferably at the address it was built at.
+ */
+static cyaml_t *
+cyaml_cache_load(char *path, uint64_t key, uint64_t key_high)
+{
+	char head[CYAML_CHUNK_HEADER + sizeof(cyaml_cache_t)], *image;
+	cyaml_cache_t header;
+	cyaml_doc_t *doc;
+	struct stat st;
+	uint64_t *relocs, i;
+	uintptr_t pointer;
+	int fd;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || pread(fd, head, sizeof(head), 0) != (ssize_t) sizeof(head)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* anything that does not look like an image built for this input
+	 * on this kind of machine is a miss */
+	memcpy(&header, head + CYAML_CHUNK_HEADER, sizeof(header));
+	if (header.magic != CYAML_CACHE_MAGIC + sizeof(void *) || header.key != key
+	    || header.key_high != key_high || header.size != (uint64_t) st.st_size
+	    || header.size > CYAML_CACHE_MAX || header.size < sizeof(head) + sizeof(cyaml_doc_t)
+	    || header.doc > header.size - sizeof(cyaml_doc_t)
+	    || header.relocs > header.size || header.relocs % sizeof(*relocs)
+	    || header.relocations > (header.size - header.relocs) / sizeof(*relocs)) {
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap((void *) (uintptr_t) header.base, header.size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | CYAML_MAP_NOREPLACE, fd, 0);
+	if (image == MAP_FAILED) {
+		image = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (image == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* the pages written to by the relocation are no longer shared */
+	if ((uintptr_t) image != header.base) {
+		relocs = (uint64_t *) (image + header.relocs);
+		for (i = 0; i < header.relocations; i++) {
+			if (relocs[i] > header.size - sizeof(pointer)) {
+				munmap(image, header.size);
+				return NULL;
+			}
+			memcpy(&pointer, image + relocs[i], sizeof(pointer));
+			pointer += (uintptr_t) image - (uintptr_t) header.base;
+			memcpy(image + relocs[i], &pointer, sizeof(pointer));
+		}
+	}
+
+	/* the image may be mapped where a document was freed before */
+	doc = (cyaml_doc_t *) (image + header.doc);
+	CYAML_STAMP(doc);
+	return &doc->root;
+}
+
+/**
+ * @Internal: Writes the image of 'cyaml' to a temporary file that is
+ * renamed to 'path' once complete, so that others either see all of
+ * it or nothing.
+ */
+static int
+cyaml_cache_write(char *path, char *image, size_t size)
+{
+	char tmp[CYAML_MAX_PATH + 32];
+	ssize_t written;
+	size_t done = 0;
+	int fd;
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		return 0;
+	}
+
+	while (done < size) {
+		written = write(fd, image + done, size - done);
+		if (written <= 0) {
+			break;
+		}
+		done += written;
+	}
+
+	if (close(fd) != 0 || done < size || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @Internal: Builds the image of 'cyaml' in a single chunk mapped at an
+ * address picked by 'key', adds it to the cache at 'path' and returns
+ * the document mapped from there. Returns 'cyaml' itself if the image
+ * cannot be built or stored.
+ */
+static cyaml_t *
+cyaml_cache_store(char *path, uint64_t key, uint64_t key_high, cyaml_t *cyaml)
+{
+	cyaml_cache_slots_t slots = { 0 };
+	cyaml_cache_t *header;
+	cyaml_chunk_t *chunk;
+	cyaml_arena_t arena;
+	cyaml_doc_t *doc;
+	cyaml_t *cached = NULL;
+	uint64_t *relocs = NULL;
+	size_t page, size, i, n;
+	void *hint = NULL;
+	char *image;
+	if (sizeof(void *) >= 8) {
+		hint = (void *) (uintptr_t) (CYAML_CACHE_BASE + key % CYAML_CACHE_SLOTS * CYAML_CACHE_MAX);
+	}
+
+	image = mmap(hint, CYAML_CACHE_MAX, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | CYAML_MAP_NOREPLACE, -1, 0);
+	if (image == MAP_FAILED) {
+		image = mmap(NULL, CYAML_CACHE_MAX, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (image == MAP_FAILED) {
+			return cyaml;
+		}
+	}
+
+	chunk = (cyaml_chunk_t *) image;
+	chunk->next = NULL;
+	chunk->size = CYAML_CACHE_MAX - CYAML_CHUNK_HEADER;
+	chunk->mapped = 0;
+	chunk->pages = CYAML_PAGES_DEFAULT;
+	chunk->node = -1;
+	cyaml_arena_init(&arena, NULL, 0);
+	arena.chunks = chunk;
+	arena.base = image + CYAML_CHUNK_HEADER;
+	arena.size = chunk->size;
+
+	header = cyaml_arena_calloc(&arena, sizeof(*header));
+	doc = header ? cyaml_arena_calloc(&arena, sizeof(*doc)) : NULL;
+	if (doc && cyaml_copy_doc(&arena, doc, cyaml)) {
+		slots.image = image;
+		if (cyaml_cache_node(&slots, &doc->root)) {
+			relocs = cyaml_arena_alloc(&arena, (slots.size + 2) * sizeof(*relocs));
+		}
+	}
+
+	/* an image spilling into a second chunk is too large to cache */
+	if (relocs && arena.chunks == chunk && !chunk->next) {
+		page = (size_t) sysconf(_SC_PAGESIZE);
+		size = CYAML_CHUNK_HEADER + arena.used;
+		chunk->size = arena.size = arena.used;
+		chunk->mapped = (size + page - 1) & ~(page - 1);
+		doc->arena = arena;
+
+		/* sorted so that relocating walks the image front to back, the
+		 * document comes before all of its nodes; shared nodes were
+		 * seen once per parent but must be relocated once */
+		relocs[0] = (uint64_t) ((char *) &doc->arena.base - image);
+		relocs[1] = (uint64_t) ((char *) &doc->arena.chunks - image);
+		qsort(slots.offsets, slots.size, sizeof(*slots.offsets), cyaml_cache_compare);
+		for (i = 0, n = 2; i < slots.size; i++) {
+			if (!i || slots.offsets[i] != slots.offsets[i - 1]) {
+				relocs[n++] = slots.offsets[i];
+			}
+		}
+
+		header->magic = CYAML_CACHE_MAGIC + sizeof(void *);
+		header->key = key;
+		header->key_high = key_high;
+		header->base = (uintptr_t) image;
+		header->size = size;
+		header->doc = (uint64_t) ((char *) doc - image);
+		header->relocs = (uint64_t) ((char *) relocs - image);
+		header->relocations = n;
+		if (cyaml_cache_write(path, image, size)) {
+			munmap(image, CYAML_CACHE_MAX);
+			image = NULL;
+			cached = cyaml_cache_load(path, key, key_high);
+		}
+	}
+
+	CYAML_FREE(slots.offsets);
+	if (image) {
+		/* chunks the arena grew besides the image go, the image is
+		 * not a chunk of its own until it is complete */
+		for (chunk = arena.chunks; chunk; chunk = arena.chunks) {
+			arena.chunks = chunk->next;
+			if ((char *) chunk != image) {
+				chunk->next = NULL;
+				cyaml_chunks_free(chunk);
+			}
+		}
+		munmap(image, CYAML_CACHE_MAX);
+	}
+
+	if (!cached) {
+		return cyaml;
+	}
+	cyaml_free(cyaml);
+	return cached;
+}
+
+/**
+ * @Internal: 'cyaml_parse_opts' with a cache directory.
+ */
+static cyaml_t *
+cyaml_cache_parse(char *s, size_t n, cyaml_loc_t loc, cyaml_options_t *options)
+{
+	char path[CYAML_MAX_PATH], *buffer = s;
+	cyaml_arena_t input, arena;
+	cyaml_t *cyaml;
+	uint64_t key, key_high;
+	size_t size = n;
+	cyaml_arena_init(&input, NULL, 0);
+	if (strlen(options->cache) + 48 > CYAML_MAX_PATH) {
+		/* the images would not have a path, so there is no cache */
+		cyaml_arena_init(&arena, NULL, 0);
+		arena.pages = options->pages;
+		return cyaml_parse_arena(&arena, s, n, loc, options);
+	}
+	if (loc == CYAML_LOC_DISK) {
+		buffer = cyaml_read_file(&input, s, n, &size, options->max_bytes);
+		if (!buffer) {
+			return NULL;
+		}
+	}
+
+	key = cyaml_cache_key(buffer, size, options, &key_high);
+	snprintf(path, sizeof(path), "%s/%016llx%016llx.cyaml", options->cache,
+		 (unsigned long long) key_high, (unsigned long long) key);
+	cyaml = cyaml_cache_load(path, key, key_high);
+	if (!cyaml) {
+		cyaml_arena_init(&arena, NULL, 0);
+		arena.pages = options->pages;
+		cyaml = cyaml_parse_arena(&arena, buffer, size, CYAML_LOC_MEMORY, options);
+		cyaml = cyaml ? cyaml_cache_store(path, key, key_high, cyaml) : NULL;
+	}
+
+	if (buffer != s) {
+		cyaml_arena_pop(&input, buffer, size + 1);
+	}
+	return cyaml;
+}
+#endif /* CYAML_HAVE_MMAP */
+
+/**
+ * Returns the NUMA node of the cpu the calling thread runs on, or -1 if
+ * it is not known.
+ */
+CYAMLDEF int
+cyaml_numa_node(void)
+{
+#if defined(CYAML_HAVE_MMAP) && defined(SYS_getcpu)
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+		return (int) node;
+	}
+#endif /* SYS_getcpu */
+	return -1;
+}
+
+/**
+ * Frees 'cyaml' like 'cyaml_free', but keeps up to CYAML_RETAIN_MAX
+ * bytes of its memory for the following parses to allocate from, so
+ * that they neither ask the allocator for memory nor fault it in again.
+ */
+CYAMLDEF void
+cyaml_recycle(cyaml_t *cyaml)
+{
+	cyaml_chunk_t *chunk, *next, *rest = NULL;
+	if (!cyaml) {
+		return;
+	}
+
+	chunk = CYAML_DOC(cyaml)->arena.chunks;
+	CYAML_CHUNK_LOCK();
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		if (chunk->size <= CYAML_RETAIN_MAX - cyaml_retained_size) {
+			chunk->next = cyaml_retained;
+			cyaml_retained = chunk;
+			cyaml_retained_size += chunk->size;
+		} else {
+			chunk->next = rest;
+			rest = chunk;
+		}
+	}
+	CYAML_CHUNK_UNLOCK();
+	cyaml_chunks_drop(rest);
+}
+
+/**
+ * Frees the memory kept by 'cyaml_recycle'.
+ */
+CYAMLDEF void
+cyaml_trim(void)
+{
+	cyaml_chunk_t *chunks;
+	CYAML_CHUNK_LOCK();
+	chunks = cyaml_retained;
+	cyaml_retained = NULL;
+	cyaml_retained_size = 0;
+	CYAML_CHUNK_UNLOCK();
+	cyaml_chunks_drop(chunks);
+}
+
+/**
+ * Returns the content hash of 'cyaml', equal for nodes of equal content
+ * no matter where they are or in which document, and stores the upper
+ * half of a 128-bit hash in 'high' unless it is NULL (0 if the document
+ * was parsed with CYAML_HASH_64). Returns 0 if the document was parsed
+ * with CYAML_HASH_NONE.
+ */
+CYAMLDEF uint64_t
+cyaml_node_hash(cyaml_t *cyaml, uint64_t *high)
+{
+	if (high) {
+		*high = cyaml ? cyaml->hash_high : 0;
+	}
+	return cyaml ? cyaml->hash : 0;
+}
+
+/**
+ * @Internal: The state of 'cyaml_diff', 'path' holding the path of the
+ * nodes being compared.
+ */
+typedef struct cyaml_diff_t {
+	cyaml_diff_fn fn;
+	void *data;
+	char *path;
+	size_t len;
+	size_t capacity;
+} cyaml_diff_t;
+
+/**
+ * @Internal: Appends '.key' (or 'key' at the root) or '[index]' to the
+ * path, returning the length to cut the path back to afterwards or
+ * SIZE_MAX if out of memory.
+ */
+static size_t
+cyaml_diff_push(cyaml_diff_t *diff, char *key, size_t len, size_t index)
+{
+	char *path, number[32];
+	size_t old_len = diff->len;
+	if (!key) {
+		len = (size_t) snprintf(number, sizeof(number), "[%zu]", index);
+		key = number;
+	}
+
+	if (old_len + len + 2 > diff->capacity) {
+		size_t capacity = (old_len + len + 2) * 2;
+		path = CYAML_REALLOC(diff->path, capacity);
+		if (!path) {
+			cyaml_log_message("Ran out of memory!");
+			return SIZE_MAX;
+		}
+		diff->path = path;
+		diff->capacity = capacity;
+	}
+
+	if (key != number && old_len > 0) {
+		diff->path[diff->len++] = '.';
+	}
+	memcpy(diff->path + diff->len, key, len);
+	diff->len += len;
+	diff->path[diff->len] = '\0';
+	return old_len;
+}
+
+static int
+cyaml_diff_report(cyaml_diff_t *diff, enum cyaml_diff_op op, cyaml_t *old_node,
+		  cyaml_t *new_node)
+{
+	if (!diff->path && cyaml_diff_push(diff, "", 0, 0) == SIZE_MAX) {
+		return -1;
+	}
+	return diff->fn(op, diff->path, old_node, new_node, diff->data);
+}
+
+#define CYAML_DIFF_EQUALP(a, b) ((a) == (b) || ((a)->hash && (a)->hash == (b)->hash \
+				 && (a)->hash_high == (b)->hash_high && (a)->type == (b)->type))
+
+/**
+ * @Internal: Returns the index past the block starting at 'i' if both
+ * nodes hold the same items or entries in it, 'i' otherwise.
+ */
+static size_t
+cyaml_diff_skip(cyaml_t *old_node, cyaml_t *new_node, size_t i)
+{
+	size_t block = i / CYAML_HASH_BLOCK;
+	if (i % CYAML_HASH_BLOCK || !old_node->blocks || !new_node->blocks
+	    || i >= old_node->size || i >= new_node->size
+	    || old_node->blocks[block] != new_node->blocks[block]) {
+		return i;
+	}
+	return i + CYAML_HASH_BLOCK;
+}
+
+/**
+ * @Internal: Finds the value of the key of 'entry' in 'mapping', first
+ * trying the entry at the same index, where it is in documents that
+ * only changed a little.
+ */
+static cyaml_t *
+cyaml_diff_find(cyaml_t *mapping, size_t i, cyaml_dict_t *entry)
+{
+	if (i < mapping->size && mapping->storage.data[i].len == entry->len
+	    && !memcmp(mapping->storage.data[i].key, entry->key, entry->len)) {
+		return mapping->storage.data[i].value;
+	}
+	return cyaml_mapping_find(mapping, entry->key, entry->len);
+}
+
+static int
+cyaml_diff_node(cyaml_diff_t *diff, cyaml_t *old_node, cyaml_t *new_node)
+{
+	cyaml_dict_t *entry;
+	cyaml_t *other;
+	size_t i, next, len;
+	int result;
+	/* equal hashes mean equal subtrees, which are not looked into */
+	if (CYAML_DIFF_EQUALP(old_node, new_node)) {
+		return 0;
+	}
+
+	if (old_node->type != new_node->type
+	    || (old_node->type == CYAML_STORAGE_SCALAR
+		&& (old_node->size != new_node->size
+		    || memcmp(old_node->storage.scalar, new_node->storage.scalar, old_node->size)))) {
+		return cyaml_diff_report(diff, CYAML_DIFF_CHANGED, old_node, new_node);
+	}
+
+	if (old_node->type == CYAML_STORAGE_SCALAR) {
+		return 0;
+	}
+
+	if (old_node->type == CYAML_STORAGE_LIST) {
+		for (i = 0; i < old_node->size || i < new_node->size; i++) {
+			if ((next = cyaml_diff_skip(old_node, new_node, i)) != i) {
+				i = next - 1;
+				continue;
+			}
+
+			if ((len = cyaml_diff_push(diff, NULL, 0, i)) == SIZE_MAX) {
+				return -1;
+			}
+
+			if (i >= new_node->size) {
+				result = cyaml_diff_report(diff, CYAML_DIFF_REMOVED,
+							   old_node->storage.items[i], NULL);
+			} else if (i >= old_node->size) {
+				result = cyaml_diff_report(diff, CYAML_DIFF_ADDED, NULL,
+							   new_node->storage.items[i]);
+			} else {
+				result = cyaml_diff_node(diff, old_node->storage.items[i],
+							 new_node->storage.items[i]);
+			}
+
+			diff->path[diff->len = len] = '\0';
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	for (i = 0; i < old_node->size; i++) {
+		if ((next = cyaml_diff_skip(old_node, new_node, i)) != i) {
+			i = next - 1;
+			continue;
+		}
+
+		entry = old_node->storage.data + i;
+		other = cyaml_diff_find(new_node, i, entry);
+		if (other && CYAML_DIFF_EQUALP(other, entry->value)) {
+			continue;
+		}
+
+		if ((len = cyaml_diff_push(diff, entry->key, entry->len, 0)) == SIZE_MAX) {
+			return -1;
+		}
+
+		if (other) {
+			result = cyaml_diff_node(diff, entry->value, other);
+		} else {
+			result = cyaml_diff_report(diff, CYAML_DIFF_REMOVED, entry->value, NULL);
+		}
+
+		diff->path[diff->len = len] = '\0';
+		if (result) {
+			return result;
+		}
+	}
+
+	for (i = 0; i < new_node->size; i++) {
+		if ((next = cyaml_diff_skip(old_node, new_node, i)) != i) {
+			i = next - 1;
+			continue;
+		}
+
+		entry = new_node->storage.data + i;
+		if (cyaml_diff_find(old_node, i, entry)) {
+			continue;
+		}
+
+		if ((len = cyaml_diff_push(diff, entry->key, entry->len, 0)) == SIZE_MAX) {
+			return -1;
+		}
+		result = cyaml_diff_report(diff, CYAML_DIFF_ADDED, NULL, entry->value);
+		diff->path[diff->len = len] = '\0';
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Walks 'old_node' and 'new_node' in lockstep and calls 'fn' for every
+ * path that was added, removed or changed, with the path in the syntax of
+ * 'cyaml_lookup'. Subtrees with equal content hashes are skipped
+ * without being looked into, so only the changed parts of two large
+ * documents are walked. List items are compared by index and the
+ * order of the keys of a mapping does not matter. Returns what 'fn'
+ * returned if it stopped the walk, -1 if out of memory and 0 otherwise.
+ */
+CYAMLDEF int
+cyaml_diff(cyaml_t *old_node, cyaml_t *new_node, cyaml_diff_fn fn, void *data)
+{
+	cyaml_diff_t diff;
+	int result;
+	if (!old_node || !new_node || !fn) {
+		return 0;
+	}
+
+	memset(&diff, 0, sizeof(diff));
+	diff.fn = fn;
+	diff.data = data;
+	result = cyaml_diff_node(&diff, old_node, new_node);
+	CYAML_FREE(diff.path);
+	return result;
+}
+
+/**
+ * @Internal: Reads a key of a query, quoted or ending at the next '.',
+ * '[' or ']', copying it into 'pool'.
+ */
+static char *
+cyaml_query_key(char *query, char **pool, size_t *len, char *stop)
+{
+	char *end;
+	if (*query == '"') {
+		end = strchr(query + 1, '"');
+		if (!end) {
+			return NULL;
+		}
+		*len = (size_t) (end - query - 1);
+		memcpy(*pool, query + 1, *len);
+		end++;
+	} else {
+		end = query + strcspn(query, stop);
+		*len = (size_t) (end - query);
+		memcpy(*pool, query, *len);
+	}
+	(*pool)[*len] = '\0';
+	return end;
+}
+
+/**
+ * @Internal: Reads a number of a query into '*number', NULL if there is
+ * none or it does not fit a long.
+ */
+static char *
+cyaml_query_number(char *query, long *number)
+{
+	char *end;
+	errno = 0;
+	*number = strtol(query, &end, 10);
+	return end == query || errno == ERANGE ? NULL : end;
+}
+
+static char *
+cyaml_query_bracket(char *query, cyaml_query_step_t *step, char **pool)
+{
+	int quoted;
+	if (*query == '*' && query[1] == ']') {
+		step->op = CYAML_QUERY_SLICE;
+		step->first = 0;
+		step->last = LONG_MAX;
+		return query + 1;
+	}
+
+	if (*query == '?') {
+		step->op = CYAML_QUERY_FILTER;
+		step->key = *pool;
+		quoted = query[1] == '"';
+		query = cyaml_query_key(query + 1, pool, &step->len, "!=]");
+		if (!query || (step->len == 0 && !quoted)
+		    || (*query != '=' && strncmp(query, "!=", 2) != 0)) {
+			return NULL;
+		}
+		*pool += step->len + 1;
+
+		step->negate = *query == '!';
+		query += step->negate ? 2 : 1;
+		step->value = *pool;
+		query = cyaml_query_key(query, pool, &step->len, "]");
+		if (!query) {
+			return NULL;
+		}
+		*pool += step->len + 1;
+		return query;
+	}
+
+	step->op = CYAML_QUERY_INDEX;
+	step->first = 0;
+	if (*query != ':') {
+		query = cyaml_query_number(query, &step->first);
+		if (!query) {
+			return NULL;
+		}
+	}
+
+	if (*query == ':') {
+		step->op = CYAML_QUERY_SLICE;
+		query++;
+		step->last = LONG_MAX;
+		if (*query != ']') {
+			query = cyaml_query_number(query, &step->last);
+		}
+	}
+	return query;
+}
+
+CYAMLDEF cyaml_query_t *
+cyaml_query_compile(char *query)
+{
+	cyaml_query_t *plan;
+	cyaml_query_step_t *step;
+	char *p, *pool;
+	size_t len;
+	int quoted;
+	if (!query) {
+		return NULL;
+	}
+
+	/* every step is at least one character long, and a step copies at
+	 * most its own characters plus a nul-terminator into the pool */
+	len = strlen(query);
+	plan = CYAML_CALLOC(1, sizeof(*plan) + (len + 1) * sizeof(*plan->steps) + 2 * (len + 1));
+	if (!plan) {
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
+	}
+
+	plan->steps = (cyaml_query_step_t *) (plan + 1);
+	pool = (char *) (plan->steps + len + 1);
+	p = query;
+	while (p && *p != '\0') {
+		step = plan->steps + plan->size++;
+		if (*p == '[') {
+			p = cyaml_query_bracket(p + 1, step, &pool);
+			if (!p || *p != ']') {
+				p = NULL;
+				break;
+			}
+			p++;
+		} else {
+			quoted = *p == '"';
+			step->key = pool;
+			p = cyaml_query_key(p, &pool, &step->len, ".[");
+			if (!p || (step->len == 0 && !quoted)) {
+				p = NULL;
+				break;
+			}
+
+			step->op = CYAML_QUERY_KEY;
+			if (step->len > 0 && step->key[step->len - 1] == '*' && !quoted) {
+				step->op = CYAML_QUERY_PREFIX;
+				step->key[--step->len] = '\0';
+			} else if (quoted && *p == '*') {
+				step->op = CYAML_QUERY_PREFIX;
+				p++;
+			}
+			pool += step->len + 1;
+		}
+
+		/* a step ends the query or is followed by the next one */
+		if (*p == '.') {
+			if (*++p == '\0') {
+				p = NULL;
+			}
+		} else if (*p != '[' && *p != '\0') {
+			p = NULL;
+		}
+	}
+
+	if (!p) {
+		cyaml_log_message("Invalid query '%s'!", query);
+		CYAML_FREE(plan);
+		return NULL;
+	}
+	return plan;
+}
+
+typedef struct cyaml_query_state_t {
+	cyaml_query_t *query;
+	size_t step;
+	cyaml_query_fn fn;
+	void *data;
+} cyaml_query_state_t;
+
+static int
+cyaml_query_run(cyaml_query_state_t *state, size_t step, cyaml_t *cyaml);
+
+static int
+cyaml_query_prefix(cyaml_dict_t *entry, void *data)
+{
+	cyaml_query_state_t *state = data;
+	return cyaml_query_run(state, state->step + 1, entry->value);
+}
+
+/**
+ * @Internal: Checks whether 'cyaml' passes the filter 'step', paths of
+ * filters are resolved just like the paths of 'cyaml_lookup'.
+ */
+static int
+cyaml_query_filter(cyaml_query_step_t *step, cyaml_t *cyaml)
+{
+	cyaml_t *value;
+	size_t len;
+	value = cyaml_lookup_path(cyaml, step->key);
+	len = strlen(step->value);
+	if (!value || value->type != CYAML_STORAGE_SCALAR) {
+		return step->negate;
+	}
+	return (value->size == len && memcmp(value->storage.scalar, step->value, len) == 0)
+		!= step->negate;
+}
+
+/**
+ * @Internal: Runs the steps of the query starting at 'step' against
+ * 'cyaml', every node reached by the last step is handed to the caller.
+ * Keys are resolved through the index of a mapping, so only the parts
+ * of the tree that can match are ever visited.
+ */
+static int
+cyaml_query_run(cyaml_query_state_t *state, size_t step, cyaml_t *cyaml)
+{
+	cyaml_query_state_t prefix;
+	cyaml_query_step_t *op;
+	long i, first, last, size;
+	int result;
+	if (!cyaml) {
+		return 0;
+	}
+
+	if (step == state->query->size) {
+		return state->fn(cyaml, state->data);
+	}
+
+	op = state->query->steps + step;
+	size = (long) cyaml->size;
+	switch (op->op) {
+	case CYAML_QUERY_KEY:
+		return cyaml_query_run(state, step + 1, cyaml_mapping_find(cyaml, op->key, op->len));
+	case CYAML_QUERY_PREFIX:
+		if (cyaml->type == CYAML_STORAGE_MAPPING) {
+			prefix = *state;
+			prefix.step = step;
+			return cyaml_foreach_prefix(cyaml, op->key, cyaml_query_prefix, &prefix);
+		}
+
+		if (cyaml->type != CYAML_STORAGE_LIST || op->len != 0) {
+			return 0;
+		}
+		/* a bare '*' matches every item of a list */
+		first = 0;
+		last = size;
+		break;
+	case CYAML_QUERY_INDEX:
+		i = op->first < 0 ? op->first + size : op->first;
+		if (cyaml->type != CYAML_STORAGE_LIST || i < 0 || i >= size) {
+			return 0;
+		}
+		return cyaml_query_run(state, step + 1, cyaml->storage.items[i]);
+	case CYAML_QUERY_SLICE:
+		if (cyaml->type != CYAML_STORAGE_LIST) {
+			return 0;
+		}
+
+		first = op->first < 0 ? op->first + size : op->first;
+		last = op->last < 0 ? op->last + size : op->last;
+		first = first < 0 ? 0 : first;
+		last = last > size ? size : last;
+		break;
+	case CYAML_QUERY_FILTER:
+		if (cyaml->type != CYAML_STORAGE_LIST) {
+			return cyaml_query_filter(op, cyaml)
+				? cyaml_query_run(state, step + 1, cyaml) : 0;
+		}
+
+		for (i = 0; i < size; i++) {
+			if (cyaml_query_filter(op, cyaml->storage.items[i])
+			    && (result = cyaml_query_run(state, step + 1, cyaml->storage.items[i]))) {
+				return result;
+			}
+		}
+		return 0;
+	default:
+		return 0;
+	}
+
+	for (i = first; i < last; i++) {
+		if ((result = cyaml_query_run(state, step + 1, cyaml->storage.items[i]))) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+CYAMLDEF int
+cyaml_query(cyaml_query_t *query, cyaml_t *cyaml, cyaml_query_fn fn, void *data)
+{
+	cyaml_query_state_t state;
+	if (!query || !cyaml || !fn) {
+		return 0;
+	}
+
+	state.query = query;
+	state.step = 0;
+	state.fn = fn;
+	state.data = data;
+	return cyaml_query_run(&state, 0, cyaml);
+}
+
+CYAMLDEF void
+cyaml_query_free(cyaml_query_t *query)
+{
+	CYAML_FREE(query);
+}
+
+/**
+ * @Internal: A list is homogeneous if all of its items are mappings
+ * with the same keys as the first item, each holding a scalar.
+ */
+static int
+cyaml_columns_homogeneous(cyaml_t *list)
+{
+	cyaml_t *first, *row, *value;
+	size_t i, j;
+	first = list->storage.items[0];
+	if (first->type != CYAML_STORAGE_MAPPING) {
+		return 0;
+	}
+
+	for (i = 0; i < list->size; i++) {
+		row = list->storage.items[i];
+		if (row->type != CYAML_STORAGE_MAPPING || row->size != first->size) {
+			return 0;
+		}
+
+		for (j = 0; j < first->size; j++) {
+			value = cyaml_mapping_find(row, first->storage.data[j].key,
+						   first->storage.data[j].len);
+			if (!value || value->type != CYAML_STORAGE_SCALAR) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+CYAMLDEF cyaml_columns_t *
+cyaml_columns(cyaml_t *list)
+{
+	cyaml_columns_t *columns;
+	cyaml_column_t *column;
+	cyaml_t *first, *value;
+	size_t i, j, offset;
+	if (!list || list->type != CYAML_STORAGE_LIST || list->size == 0) {
+		cyaml_log_message("Columns need a non-empty list!");
+		return NULL;
+	}
+
+	if (!cyaml_columns_homogeneous(list)) {
+		cyaml_log_message("Columns need a list of mappings with the same scalar keys!");
+		return NULL;
+	}
+
+	first = list->storage.items[0];
+	columns = CYAML_CALLOC(1, sizeof(*columns) + first->size * sizeof(*columns->columns));
+	if (!columns) {
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
+	}
+
+	columns->rows = list->size;
+	columns->size = first->size;
+	columns->columns = (cyaml_column_t *) (columns + 1);
+	for (j = 0; j < columns->size; j++) {
+		columns->pool_size += first->storage.data[j].len + 1;
+		for (i = 0; i < columns->rows; i++) {
+			value = cyaml_mapping_find(list->storage.items[i], first->storage.data[j].key,
+						   first->storage.data[j].len);
+			columns->pool_size += value->size + 1;
+		}
+	}
+
+	/* the offsets live right after the (aligned) string pool */
+	columns->pool_size = (columns->pool_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+	columns->pool = CYAML_MALLOC(columns->pool_size
+				     + columns->size * (columns->rows + 1) * sizeof(size_t));
+	if (!columns->pool) {
+		CYAML_FREE(columns);
+		cyaml_log_message("Ran out of memory!");
+		return NULL;
+	}
+
+	offset = 0;
+	for (j = 0; j < columns->size; j++) {
+		column = columns->columns + j;
+		column->offsets = (size_t *) (columns->pool + columns->pool_size)
+			+ j * (columns->rows + 1);
+		column->len = first->storage.data[j].len;
+		column->key = columns->pool + offset;
+		memcpy(column->key, first->storage.data[j].key, column->len + 1);
+		offset += column->len + 1;
+
+		column->values = columns->pool + offset;
+		for (i = 0; i < columns->rows; i++) {
+			value = cyaml_mapping_find(list->storage.items[i], column->key, column->len);
+			column->offsets[i] = (size_t) (columns->pool + offset - column->values);
+			memcpy(columns->pool + offset, value->storage.scalar, value->size + 1);
+			offset += value->size + 1;
+		}
+		column->offsets[columns->rows] = (size_t) (columns->pool + offset - column->values);
+	}
+	return columns;
+}
+
+CYAMLDEF cyaml_column_t *
+cyaml_column(cyaml_columns_t *columns, char *key)
+{
+	size_t j, len;
+	if (!columns || !key) {
+		return NULL;
+	}
+
+	len = strlen(key);
+	for (j = 0; j < columns->size; j++) {
+		if (columns->columns[j].len == len && memcmp(columns->columns[j].key, key, len) == 0) {
+			return columns->columns + j;
+		}
+	}
+	return NULL;
+}
+
+CYAMLDEF void
+cyaml_columns_free(cyaml_columns_t *columns)
+{
+	if (columns) {
+		CYAML_FREE(columns->pool);
+		CYAML_FREE(columns);
+	}
+}
+
+#ifdef CYAML_FUZZ
+/**
+ * Fuzzing entry point, build with '-DCYAML_FUZZ -fsanitize=fuzzer' for
+ * libFuzzer (or AFL++'s libFuzzer driver). Add '-DCYAML_FUZZ_MAIN' to
+ * get a 'main' instead, that parses the files given to it (AFL's '@@')
+ * or stdin, and times a corpus to guard against superlinear parses:
+ *
+ * `cc -DCYAML_IMPLEMENTATION -DCYAML_FUZZ -DCYAML_FUZZ_MAIN -O2 -x c cyaml.h -o cyaml_fuzz -lm
+ *  ./cyaml_fuzz tests/corpus`
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	cyaml_t *cyaml;
+	cyaml = cyaml_parse((char *) data, size, CYAML_LOC_MEMORY);
+	cyaml_free(cyaml);
+	cyaml_log_stack_size = 0;
+	return 0;
+}
+
+#ifdef CYAML_FUZZ_MAIN
+typedef struct cyaml_fuzz_input_t {
+	char *path;
+	size_t size;
+	double ns_per_byte;
+	double growth;
+} cyaml_fuzz_input_t;
+
+static int
+cyaml_fuzz_compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @Internal: The median of CYAML_FUZZ_RUNS timings of the parse of
+ * 'data', in ns. Every timing repeats the parse for CYAML_FUZZ_SAMPLE
+ * ns at least, so the clock's resolution does not swamp small inputs.
+ */
+static double
+cyaml_fuzz_time(const char *data, size_t size)
+{
+	struct timespec start, end;
+	double times[CYAML_FUZZ_RUNS], elapsed;
+	size_t repeat = 1, i;
+	int run;
+	for (run = 0; run < CYAML_FUZZ_RUNS; run++) {
+		for (;;) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < repeat; i++) {
+				LLVMFuzzerTestOneInput((const uint8_t *) data, size);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			elapsed = (double) (end.tv_sec - start.tv_sec) * 1e9
+				+ (double) (end.tv_nsec - start.tv_nsec);
+			if (elapsed >= CYAML_FUZZ_SAMPLE || repeat > SIZE_MAX / 2) {
+				break;
+			}
+			repeat *= 2;
+		}
+		times[run] = elapsed / (double) repeat;
+	}
+	qsort(times, CYAML_FUZZ_RUNS, sizeof(*times), cyaml_fuzz_compare);
+	return times[CYAML_FUZZ_RUNS / 2];
+}
+
+/**
+ * @Internal: Times the parse of the file at 'path'. Besides the time
+ * per byte, the input is also parsed up to the first line break past
+ * a half, a quarter, ... of it (CYAML_FUZZ_SIZES sizes in all), the
+ * growth being the slope of a least squares fit of the times over the
+ * sizes on a log-log scale: 1.0 for a linear parse, 2.0 for a
+ * quadratic one.
+ */
+static int
+cyaml_fuzz_measure(cyaml_fuzz_input_t *input)
+{
+	cyaml_arena_t arena = { 0 };
+	double x, y, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0, points = 0.0, full;
+	size_t size, len, last = 0;
+	char *buffer, *cut;
+	int k;
+	buffer = cyaml_read_file(&arena, input->path, strlen(input->path), &size, SIZE_MAX);
+	if (!buffer) {
+		return 0;
+	}
+
+	input->size = size;
+	full = cyaml_fuzz_time(buffer, size);
+	input->ns_per_byte = full / (double) size;
+	input->growth = 1.0;
+
+	for (k = 0; size >= CYAML_FUZZ_MIN_SIZE && k < CYAML_FUZZ_SIZES; k++) {
+		cut = k ? memchr(buffer + (size >> k), '\n', size - (size >> k)) : buffer + size;
+		len = cut ? (size_t) (cut - buffer) : 0;
+		if (len == 0 || len == last) {
+			continue;
+		}
+
+		x = log((double) len);
+		y = log(k ? cyaml_fuzz_time(buffer, len) : full);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+		points += 1.0;
+		last = len;
+	}
+
+	if (points > 1.0 && points * sxx - sx * sx > 0.0) {
+		input->growth = (points * sxy - sx * sy) / (points * sxx - sx * sx);
+	}
+	cyaml_arena_pop(&arena, buffer, size + 1);
+	return 1;
+}
+
+static int
+cyaml_fuzz_add(cyaml_fuzz_input_t **inputs, size_t *size, size_t *capacity, char *path)
+{
+	cyaml_fuzz_input_t *data;
+	if (*size == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		data = CYAML_REALLOC(*inputs, *capacity * sizeof(**inputs));
+		if (!data) {
+			return 0;
+		}
+		*inputs = data;
+	}
+
+	(*inputs)[*size].path = strdup(path);
+	return (*inputs)[(*size)++].path != NULL;
+}
+
+/**
+ * Parses the files and directories given, or stdin if there are none.
+ * Inputs of at least CYAML_FUZZ_MIN_SIZE bytes taking more than
+ * CYAML_FUZZ_SLOWDOWN times the corpus' median time per byte, or
+ * growing by more than CYAML_FUZZ_GROWTH, are reported and make the
+ * program exit with 1.
+ */
+int
+main(int argc, char **argv)
+{
+	cyaml_fuzz_input_t *inputs = NULL;
+	size_t size = 0, capacity = 0, i, j, measured = 0, flagged = 0;
+	double *speeds, median;
+	char path[4096];
+	struct dirent *entry;
+	DIR *dir;
+	if (argc < 2) {
+		char *buffer = NULL;
+		size_t nread = 0, n;
+		do {
+			buffer = CYAML_REALLOC(buffer, nread + 65536);
+			if (!buffer) {
+				return 1;
+			}
+			n = fread(buffer + nread, 1, 65536, stdin);
+			nread += n;
+		} while (n > 0);
+		LLVMFuzzerTestOneInput((const uint8_t *) buffer, nread);
+		CYAML_FREE(buffer);
+		return 0;
+	}
+
+	for (i = 1; i < (size_t) argc; i++) {
+		dir = opendir(argv[i]);
+		if (!dir) {
+			if (!cyaml_fuzz_add(&inputs, &size, &capacity, argv[i])) {
+				return 1;
+			}
+			continue;
+		}
+
+		while ((entry = readdir(dir))) {
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+			if (!cyaml_fuzz_add(&inputs, &size, &capacity, path)) {
+				return 1;
+			}
+		}
+		closedir(dir);
+	}
+
+	speeds = CYAML_MALLOC((size + 1) * sizeof(*speeds));
+	if (!speeds) {
+		return 1;
+	}
+
+	for (i = 0, j = 0; i < size; i++) {
+		if (cyaml_fuzz_measure(inputs + i)) {
+			inputs[j++] = inputs[i];
+		} else {
+			free(inputs[i].path);
+		}
+	}
+	size = j;
+
+	for (i = 0; i < size; i++) {
+		if (inputs[i].size >= CYAML_FUZZ_MIN_SIZE) {
+			speeds[measured++] = inputs[i].ns_per_byte;
+		}
+	}
+	qsort(speeds, measured, sizeof(*speeds), cyaml_fuzz_compare);
+	median = measured ? speeds[measured / 2] : 0.0;
+
+	for (i = 0; i < size; i++) {
+		if (inputs[i].size >= CYAML_FUZZ_MIN_SIZE
+		    && (inputs[i].ns_per_byte > CYAML_FUZZ_SLOWDOWN * median
+			|| inputs[i].growth > CYAML_FUZZ_GROWTH)) {
+			printf("slow: %s (%zu bytes, %.2f ns/byte, median %.2f ns/byte, growth %.2f)\n",
+			       inputs[i].path, inputs[i].size, inputs[i].ns_per_byte,
+			       median, inputs[i].growth);
+			flagged++;
+		}
+		free(inputs[i].path);
+	}
+	printf("%zu inputs, %zu timed, %zu flagged\n", size, measured, flagged);
+
+	CYAML_FREE(speeds);
+	CYAML_FREE(inputs);
+	return flagged ? 1 : 0;
+}
+#endif /* CYAML_FUZZ_MAIN */
+#endif /* CYAML_FUZZ */
+
+#ifdef CYAML_STRESS
+/**
+ * Stress test of concurrent reads, build with '-DCYAML_STRESS
+ * -DCYAML_THREADS -pthread' (adding '-fsanitize=thread' to have races
+ * reported) to get a 'main' that looks up every path of the document
+ * given to it from 1, 2, 4, ... threads, checks every result and shows
+ * how the lookups scale. A first round freezes the document while all
+ * of the threads are reading it:
+ *
+ * `cc -DCYAML_IMPLEMENTATION -DCYAML_STRESS -DCYAML_THREADS -O2 -pthread -x c cyaml.h -o cyaml_stress
+ *  ./cyaml_stress config.yaml 64`
+ */
+#ifndef CYAML_THREADS
+#error "CYAML_STRESS needs CYAML_THREADS"
+#endif /* CYAML_THREADS */
+
+typedef struct cyaml_stress_t {
+	cyaml_t *root;
+	char **paths;
+	cyaml_t **expected;
+	size_t size;
+	size_t capacity;
+	uint64_t seed;
+	size_t failures;
+} cyaml_stress_t;
+
+/**
+ * @Internal: Adds 'path' (of 'len' bytes in a buffer of
+ * CYAML_STRESS_PATH) and the paths of everything below 'cyaml' to the
+ * paths to look up. Paths that do not fit the buffer are left out.
+ */
+static int
+cyaml_stress_collect(cyaml_stress_t *stress, cyaml_t *cyaml, char *path, size_t len)
+{
+	size_t i, n;
+	void *data;
+	if (stress->size == stress->capacity) {
+		stress->capacity = stress->capacity ? stress->capacity * 2 : 1024;
+		data = CYAML_REALLOC(stress->paths, stress->capacity * sizeof(*stress->paths));
+		if (!data) {
+			return 0;
+		}
+		stress->paths = data;
+	}
+
+	stress->paths[stress->size] = CYAML_MALLOC(len + 1);
+	if (!stress->paths[stress->size]) {
+		return 0;
+	}
+	memcpy(stress->paths[stress->size], path, len);
+	stress->paths[stress->size++][len] = '\0';
+
+	for (i = 0; i < cyaml->size && cyaml->type != CYAML_STORAGE_SCALAR; i++) {
+		if (cyaml->type == CYAML_STORAGE_LIST) {
+			n = (size_t) snprintf(path + len, CYAML_STRESS_PATH - len, "[%zu]", i);
+			if (len + n < CYAML_STRESS_PATH
+			    && !cyaml_stress_collect(stress, cyaml->storage.items[i], path, len + n)) {
+				return 0;
+			}
+		} else {
+			n = cyaml->storage.data[i].len + (len > 0);
+			if (len + n >= CYAML_STRESS_PATH) {
+				continue;
+			}
+
+			path[len] = '.';
+			memcpy(path + len + (len > 0), cyaml->storage.data[i].key, cyaml->storage.data[i].len);
+			if (!cyaml_stress_collect(stress, cyaml->storage.data[i].value, path, len + n)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int
+cyaml_stress_count(cyaml_dict_t *entry, void *data)
+{
+	(void) entry;
+	(*(size_t *) data)++;
+	return 0;
+}
+
+/**
+ * @Internal: Makes CYAML_STRESS_LOOKUPS lookups of random paths, every
+ * result having to be the node a single thread found, and walks the
+ * keys of every mapping found.
+ */
+static void *
+cyaml_stress_main(void *data)
+{
+	cyaml_stress_t *stress = data;
+	uint64_t x = stress->seed;
+	cyaml_t *result;
+	size_t i, k, count;
+	for (i = 0; i < CYAML_STRESS_LOOKUPS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		k = (size_t) (x % stress->size);
+		result = cyaml_lookup(stress->root, stress->paths[k]);
+		if (result != stress->expected[k]) {
+			stress->failures++;
+		} else if (result && result->type == CYAML_STORAGE_MAPPING) {
+			count = 0;
+			cyaml_foreach_range(result, NULL, NULL, cyaml_stress_count, &count);
+			stress->failures += count != result->size;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @Internal: Runs a round of 'n' threads, freezing the document from
+ * the calling thread meanwhile if 'freeze' is set. Returns how long
+ * the round took in seconds, or a negative time if a thread could not
+ * be started.
+ */
+static double
+cyaml_stress_round(cyaml_stress_t *stress, cyaml_stress_t *threads, pthread_t *ids,
+		   size_t n, int freeze)
+{
+	struct timespec start, end;
+	size_t i, started;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < n; started++) {
+		threads[started] = *stress;
+		threads[started].seed = cyaml_hash_mix(started + 1);
+		threads[started].failures = 0;
+		if (pthread_create(&ids[started], NULL, cyaml_stress_main, &threads[started]) != 0) {
+			break;
+		}
+	}
+
+	if (freeze) {
+		cyaml_freeze(stress->root);
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(ids[i], NULL);
+		stress->failures += threads[i].failures;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (started < n) {
+		return -1.0;
+	}
+	return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Looks up the paths of the file given from up to as many threads as
+ * given (or cpus online), exiting with 1 if any lookup went wrong.
+ */
+int
+main(int argc, char **argv)
+{
+	cyaml_stress_t stress = { 0 }, *threads;
+	size_t max, n, i;
+	double elapsed, single = 0.0;
+	char path[CYAML_STRESS_PATH];
+	pthread_t *ids;
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s file [threads]\n", argv[0]);
+		return 2;
+	}
+
+	stress.root = cyaml_parse(argv[1], strlen(argv[1]), CYAML_LOC_DISK);
+	if (!stress.root) {
+		fprintf(stderr, "%s: %s\n", argv[1], cyaml_error_pop());
+		return 1;
+	}
+
+	max = argc > 2 ? strtoul(argv[2], NULL, 10) : (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+	max = max ? max : 1;
+	threads = CYAML_MALLOC(max * sizeof(*threads));
+	ids = CYAML_MALLOC(max * sizeof(*ids));
+	if (!threads || !ids || !cyaml_stress_collect(&stress, stress.root, path, 0)) {
+		fprintf(stderr, "Ran out of memory!\n");
+		return 1;
+	}
+
+	stress.expected = CYAML_MALLOC(stress.size * sizeof(*stress.expected));
+	if (!stress.expected) {
+		fprintf(stderr, "Ran out of memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < stress.size; i++) {
+		stress.expected[i] = cyaml_lookup(stress.root, stress.paths[i]);
+	}
+
+	printf("%zu paths\n", stress.size);
+	if (cyaml_stress_round(&stress, threads, ids, max, 1) < 0.0) {
+		fprintf(stderr, "Could not start %zu threads!\n", max);
+		return 1;
+	}
+
+	for (n = 1; n <= max; n = n < max && n * 2 > max ? max : n * 2) {
+		elapsed = cyaml_stress_round(&stress, threads, ids, n, 0);
+		if (elapsed < 0.0) {
+			fprintf(stderr, "Could not start %zu threads!\n", n);
+			return 1;
+		}
+
+		single = n == 1 ? elapsed : single;
+		printf("%3zu threads: %8.2f M lookups/s, %5.2fx\n", n,
+		       (double) (n * CYAML_STRESS_LOOKUPS) / elapsed / 1e6,
+		       (double) n * single / elapsed);
+		if (n == max) {
+			break;
+		}
+	}
+	printf("%zu failures\n", stress.failures);
+
+	for (i = 0; i < stress.size; i++) {
+		CYAML_FREE(stress.paths[i]);
+	}
+	CYAML_FREE(stress.paths);
+	CYAML_FREE(stress.expected);
+	CYAML_FREE(threads);
+	CYAML_FREE(ids);
+	cyaml_free(stress.root);
+	return stress.failures ? 1 : 0;
+}
+#endif /* CYAML_STRESS */
+
+#ifdef CYAML_BENCH
+/**
+ * Benchmark of 'cyaml_freeze', build with '-DCYAML_BENCH' to get a
+ * 'main' that parses flat mappings of 1k, 10k, ... keys, up to the
+ * number given (1M by default), and times CYAML_BENCH_LOOKUPS lookups
+ * of random keys through the trie, the freeze, and as many lookups
+ * through the perfect hash:
+ *
+ * `cc -DCYAML_IMPLEMENTATION -DCYAML_BENCH -O2 -x c cyaml.h -o cyaml_bench
+ *  ./cyaml_bench 1000000`
+ */
+#define CYAML_BENCH_KEY (24)
+
+static double
+cyaml_bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+/**
+ * @Internal: Looks up CYAML_BENCH_LOOKUPS random keys of the 'n' in
+ * 'keys', counting the ones not found in 'failures'. Returns the time
+ * per lookup in ns.
+ */
+static double
+cyaml_bench_lookups(cyaml_t *root, char *keys, size_t n, size_t *failures)
+{
+	uint64_t x = 88172645463325252ull;
+	double start;
+	size_t i;
+	start = cyaml_bench_now();
+	for (i = 0; i < CYAML_BENCH_LOOKUPS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		*failures += cyaml_lookup(root, keys + (x % n) * CYAML_BENCH_KEY) == NULL;
+	}
+	return (cyaml_bench_now() - start) * 1e9 / CYAML_BENCH_LOOKUPS;
+}
+
+/**
+ * Times lookups before and after 'cyaml_freeze' on mappings of 1k keys
+ * up to the number given, exiting with 1 if any lookup went wrong.
+ */
+int
+main(int argc, char **argv)
+{
+	size_t max, n, i, len, failures = 0;
+	double trie, perfect, freeze;
+	char *keys, *text;
+	cyaml_t *root;
+	max = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	for (n = 1000; n <= max; n *= 10) {
+		keys = CYAML_MALLOC(n * CYAML_BENCH_KEY);
+		text = CYAML_MALLOC(n * (CYAML_BENCH_KEY + 4));
+		if (!keys || !text) {
+			fprintf(stderr, "Ran out of memory!\n");
+			return 1;
+		}
+
+		for (i = 0, len = 0; i < n; i++) {
+			snprintf(keys + i * CYAML_BENCH_KEY, CYAML_BENCH_KEY, "key%zu", i);
+			len += (size_t) sprintf(text + len, "%s: %zu\n", keys + i * CYAML_BENCH_KEY, i);
+		}
+
+		root = cyaml_parse(text, len, CYAML_LOC_MEMORY);
+		if (!root) {
+			fprintf(stderr, "%s\n", cyaml_error_pop());
+			return 1;
+		}
+
+		trie = cyaml_bench_lookups(root, keys, n, &failures);
+		freeze = cyaml_bench_now();
+		cyaml_freeze(root);
+		freeze = cyaml_bench_now() - freeze;
+		perfect = cyaml_bench_lookups(root, keys, n, &failures);
+		printf("%8zu keys: trie %8.1f ns, perfect hash %8.1f ns, freeze %9.2f ms\n",
+		       n, trie, perfect, freeze * 1e3);
+
+		cyaml_free(root);
+		CYAML_FREE(text);
+		CYAML_FREE(keys);
+	}
+	printf("%zu failures\n", failures);
+	return failures ? 1 : 0;
+}
+#endif /* CYAML_BENCH */
+
+#ifdef CYAML_CHECK
+/**
+ * Regression checks, build with '-DCYAML_CHECK' to get a 'main' that
+ * runs them against the inputs in the 'tests' directory given, and
+ * checks that every way of parsing a document agrees on random ones.
+ * With CYAML_THREADS the pipelined parses are checked too, and a small
+ * CYAML_PIPELINE_CHUNK or CYAML_LOAD_STEP makes them yield more often:
+ *
+ * `cc -DCYAML_IMPLEMENTATION -DCYAML_CHECK -O2 -x c cyaml.h -o cyaml_check
+ *  ./cyaml_check tests`
+ */
+static size_t cyaml_check_failures;
+
+/**
+ * @Internal: Reports a failed check unless 'ok', returning 'ok'.
+ */
+static int
+cyaml_check(int ok, const char *what)
+{
+	if (!ok && cyaml_check_failures++ < CYAML_CHECK_REPORTS) {
+		printf("failed: %s\n", what);
+	}
+	return ok;
+}
+
+/**
+ * @Internal: Pops the messages of a failed parse, telling whether one
+ * of them starts with 'prefix'.
+ */
+static int
+cyaml_check_error(const char *prefix)
+{
+	int found = 0;
+	while (!cyaml_log_stack_empty()) {
+		found |= strncmp(cyaml_error_pop(), prefix, strlen(prefix)) == 0;
+	}
+	return found;
+}
+
+/**
+ * @Internal: Tells whether 'a' and 'b' are the same document, down to
+ * the hashes of their nodes. Either may be NULL for a failed parse.
+ */
+static int
+cyaml_check_equal(cyaml_t *a, cyaml_t *b)
+{
+	size_t i;
+	if (!a || !b) {
+		return a == b;
+	}
+
+	if (a->type != b->type || a->size != b->size || a->hash != b->hash
+	    || a->hash_high != b->hash_high) {
+		return 0;
+	}
+
+	switch (a->type) {
+	case CYAML_STORAGE_SCALAR:
+		return memcmp(a->storage.scalar, b->storage.scalar, a->size) == 0;
+	case CYAML_STORAGE_LIST:
+		for (i = 0; i < a->size; i++) {
+			if (!cyaml_check_equal(a->storage.items[i], b->storage.items[i])) {
+				return 0;
+			}
+		}
+		return 1;
+	case CYAML_STORAGE_MAPPING:
+		for (i = 0; i < a->size; i++) {
+			if (a->storage.data[i].len != b->storage.data[i].len
+			    || memcmp(a->storage.data[i].key, b->storage.data[i].key, a->storage.data[i].len) != 0
+			    || !cyaml_check_equal(a->storage.data[i].value, b->storage.data[i].value)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @Internal: Checks that 'other' is the document 'plain' is, reporting
+ * the input 'text' they were parsed from if not, and frees 'other'.
+ */
+static void
+cyaml_check_same(cyaml_t *plain, cyaml_t *other, const char *what, char *text)
+{
+	if (!cyaml_check(cyaml_check_equal(plain, other), what)
+	    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+		printf("%s\n", text);
+	}
+	cyaml_free(other);
+}
+
+/**
+ * @Internal: The nodes a walk over 'node' visits.
+ */
+static size_t
+cyaml_check_count(cyaml_t *node)
+{
+	size_t nodes = 1, i;
+	for (i = 0; node->type != CYAML_STORAGE_SCALAR && i < node->size; i++) {
+		nodes += cyaml_check_count(node->type == CYAML_STORAGE_LIST
+					   ? node->storage.items[i] : node->storage.data[i].value);
+	}
+	return nodes;
+}
+
+/**
+ * @Internal: Parses the file 'name' of the 'tests' directory.
+ */
+static cyaml_t *
+cyaml_check_parse(char *tests, const char *name, cyaml_options_t *options)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", tests, name);
+	return cyaml_parse_opts(path, strlen(path), CYAML_LOC_DISK, options);
+}
+
+/**
+ * @Internal: 'include-bomb/f<i>.yaml' includes the next file twice, down
+ * to f40.yaml, so it expands to 3 * 2^(40 - i) - 1 nodes from a handful
+ * of bytes. The files of 'include-cycle' include themselves, through
+ * './' or through one another.
+ */
+static void
+cyaml_check_includes(char *tests)
+{
+	static const char *cycles[] = {
+		"include-cycle/self.yaml", "include-cycle/dot.yaml", "include-cycle/ping.yaml"
+	};
+	cyaml_options_t options = { 0 };
+	cyaml_parse_t *parse;
+	cyaml_t *root;
+	char path[4096];
+	size_t i;
+	options.expand = 1;
+	root = cyaml_check_parse(tests, "include-bomb/f0.yaml", &options);
+	cyaml_check(!root && cyaml_check_error("Includes expand to more than"),
+		    "include bomb is stopped by max_expansion");
+	cyaml_free(root);
+
+	options.max_nodes = 1000;
+	root = cyaml_check_parse(tests, "include-bomb/f0.yaml", &options);
+	cyaml_check(!root && cyaml_check_error("Document has more than 1000 nodes"),
+		    "include bomb is stopped by max_nodes");
+	cyaml_free(root);
+
+	options.max_nodes = 0;
+	root = cyaml_check_parse(tests, "include-bomb/f30.yaml", &options);
+	cyaml_check(root && cyaml_check_count(root) == 3 * 1024 - 1,
+		    "includes within max_expansion parse whole");
+	cyaml_check(root && cyaml_freeze(root), "included documents freeze");
+	cyaml_free(root);
+
+	/* f31 ... f40 are each included once more, 3 * 1023 - 10 nodes */
+	options.max_expansion = 3 * 1023 - 10;
+	root = cyaml_check_parse(tests, "include-bomb/f30.yaml", &options);
+	cyaml_check(root != NULL, "max_expansion is inclusive");
+	cyaml_free(root);
+
+	options.max_expansion--;
+	root = cyaml_check_parse(tests, "include-bomb/f30.yaml", &options);
+	cyaml_check(!root && cyaml_check_error("Includes expand to more than"),
+		    "max_expansion counts every repeated include");
+	cyaml_free(root);
+	options.max_expansion = 0;
+
+	options.max_depth = 8;
+	root = cyaml_check_parse(tests, "include-bomb/f30.yaml", &options);
+	cyaml_check(!root && cyaml_check_error("Document is nested deeper than 8 levels"),
+		    "a chain of includes counts towards max_depth");
+	cyaml_free(root);
+	options.max_depth = 0;
+
+	snprintf(path, sizeof(path), "%s/include-bomb/f30.yaml", tests);
+	options.buffer_size = cyaml_parse_size(path, strlen(path), CYAML_LOC_DISK, &options);
+	options.buffer = CYAML_MALLOC(options.buffer_size);
+	root = options.buffer ? cyaml_parse_opts(path, strlen(path), CYAML_LOC_DISK, &options) : NULL;
+	cyaml_check(root && cyaml_check_count(root) == 3 * 1024 - 1, "includes parse into a buffer");
+	cyaml_free(root);
+	CYAML_FREE(options.buffer);
+	options.buffer = NULL;
+	options.buffer_size = 0;
+
+	for (i = 0; i < sizeof(cycles) / sizeof(*cycles); i++) {
+		root = cyaml_check_parse(tests, cycles[i], &options);
+		cyaml_check(!root && cyaml_check_error("Include cycle through"),
+			    "include cycles are found whatever the path");
+		cyaml_free(root);
+
+		snprintf(path, sizeof(path), "%s/%s", tests, cycles[i]);
+		parse = cyaml_parse_begin(path, strlen(path), CYAML_LOC_DISK, &options);
+		while (cyaml_parse_step(parse, 16) == CYAML_AGAIN);
+		root = cyaml_parse_finish(parse);
+		cyaml_check(!root && cyaml_check_error("Include cycle through"),
+			    "include cycles are found by cyaml_parse_step");
+		cyaml_free(root);
+	}
+}
+
+/**
+ * @Internal: Names of variables and paths come from the document, and
+ * are turned down past CYAML_MAX_VAR_NAME and CYAML_MAX_PATH rather
+ * than copied onto the stack.
+ */
+static void
+cyaml_check_names(void)
+{
+	cyaml_options_t options = { 0 };
+	cyaml_t *root;
+	size_t len;
+	char *text;
+	text = CYAML_MALLOC(1 << 24);
+	if (!cyaml_check(text != NULL, "names check has memory")) {
+		return;
+	}
+
+	options.expand = 1;
+	len = (size_t) sprintf(text, "k: ${%0*d:-x}\n", CYAML_MAX_VAR_NAME, 0);
+	memset(text + 5, 'A', CYAML_MAX_VAR_NAME);
+	root = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+	cyaml_check(root && strcmp(cyaml_lookup(root, "k")->storage.scalar, "x") == 0,
+		    "variables of CYAML_MAX_VAR_NAME bytes expand");
+	cyaml_free(root);
+
+	memcpy(text, "k: ${", 5);
+	memset(text + 5, 'A', (1 << 24) - 16);
+	len = (size_t) sprintf(text + 5 + (1 << 24) - 16, ":-x}\n") + 5 + (1 << 24) - 16;
+	root = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+	cyaml_check(!root && cyaml_check_error("Variable name is longer than"),
+		    "long variable names are turned down");
+	cyaml_free(root);
+
+	memset(text, 'a', CYAML_MAX_PATH);
+	root = cyaml_parse_opts(text, CYAML_MAX_PATH, CYAML_LOC_DISK, &options);
+	cyaml_check(!root && cyaml_check_error("Path is longer than"), "long paths are turned down");
+	cyaml_free(root);
+
+	len = (size_t) sprintf(text, "k: !include %0*d\n", CYAML_MAX_PATH, 0);
+	root = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+	cyaml_check(!root && cyaml_check_error("Path is longer than"), "long includes are turned down");
+	cyaml_free(root);
+	CYAML_FREE(text);
+}
+
+/**
+ * @Internal: Where the matches of a query are written, separated by
+ * commas, scalars as their text and lists and mappings as '[]' and '{}'.
+ */
+typedef struct cyaml_check_matches_t {
+	char text[256];
+	size_t len;
+} cyaml_check_matches_t;
+
+static int
+cyaml_check_match(cyaml_t *cyaml, void *data)
+{
+	cyaml_check_matches_t *matches = data;
+	size_t room = sizeof(matches->text) - matches->len;
+	matches->len += (size_t) snprintf(matches->text + matches->len, room, "%s%s",
+					  matches->len ? "," : "",
+					  cyaml->type == CYAML_STORAGE_SCALAR ? cyaml->storage.scalar
+					  : cyaml->type == CYAML_STORAGE_LIST ? "[]" : "{}");
+	return matches->len >= sizeof(matches->text);
+}
+
+/**
+ * @Internal: Runs every query of a table against one document, checking
+ * what each matched, in order, or that it does not compile (NULL).
+ */
+static void
+cyaml_check_queries(void)
+{
+	static char text[] =
+		"hosts:\n"
+		"  - name: a\n"
+		"    region: eu\n"
+		"  - name: b\n"
+		"    region: us\n"
+		"  - name: c\n"
+		"    region: eu\n"
+		"items:\n"
+		"  - 0\n"
+		"  - 1\n"
+		"  - 2\n"
+		"  - 3\n"
+		"  - 4\n"
+		"service.a: 1\n"
+		"service.b: 2\n"
+		"serviceb: 3\n"
+		"\"star*\": 4\n";
+	static const char *table[][2] = {
+		{ "hosts[*].region", "eu,us,eu" },
+		{ "hosts.*.name", "a,b,c" },
+		{ "hosts[0].name", "a" },
+		{ "hosts[-1].name", "c" },
+		{ "hosts[3].name", "" },
+		{ "hosts[-4].name", "" },
+		{ "items[1:3]", "1,2" },
+		{ "items[-2:]", "3,4" },
+		{ "items[:-3]", "0,1" },
+		{ "items[3:1]", "" },
+		{ "items[-10:10]", "0,1,2,3,4" },
+		{ "hosts[?region=eu].name", "a,c" },
+		{ "hosts[?region!=eu].name", "b" },
+		{ "hosts[?zone!=eu].name", "a,b,c" },
+		{ "hosts[?region=eu][1].name", "" },
+		{ "[?serviceb=3].items[0]", "0" },
+		{ "[?serviceb=4].items[0]", "" },
+		{ "service*", "1,2,3" },
+		{ "\"service.\"*", "1,2" },
+		{ "\"star*\"", "4" },
+		{ "star*", "4" },
+		{ "\"\"*", "[],[],1,2,3,4" },
+		{ "hosts", "[]" },
+		{ "missing.key", "" },
+		{ "\"a\"x", NULL },
+		{ "hosts[0]name", NULL },
+		{ "hosts[?=1]", NULL },
+		{ "hosts[?region]", NULL },
+		{ "items[99999999999999999999]", NULL },
+		{ "items[1:99999999999999999999]", NULL },
+		{ "items[x]", NULL },
+		{ "items[1:x]", NULL },
+		{ "items[1", NULL },
+		{ "a..b", NULL },
+		{ "a.", NULL },
+		{ "\"unterminated", NULL }
+	};
+	cyaml_check_matches_t matches;
+	cyaml_query_t *query;
+	cyaml_t *root;
+	char what[128];
+	size_t i;
+	root = cyaml_parse(text, sizeof(text) - 1, CYAML_LOC_MEMORY);
+	if (!cyaml_check(root != NULL, "query document parses")) {
+		return;
+	}
+
+	for (i = 0; i < sizeof(table) / sizeof(*table); i++) {
+		query = cyaml_query_compile((char *) table[i][0]);
+		cyaml_log_stack_size = 0;
+		matches.len = 0;
+		matches.text[0] = '\0';
+		cyaml_query(query, root, cyaml_check_match, &matches);
+		snprintf(what, sizeof(what), "query '%s' matches '%s'", table[i][0],
+			 table[i][1] ? table[i][1] : "(invalid)");
+		if (!cyaml_check(table[i][1] ? query && strcmp(matches.text, table[i][1]) == 0 : !query, what)
+		    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+			printf("%s\n", query ? matches.text : "(invalid)");
+		}
+		cyaml_query_free(query);
+	}
+	cyaml_free(root);
+}
+
+#define CYAML_CHECK_PICK(array, state) ((array)[cyaml_check_random(state) % (sizeof(array) / sizeof(*(array)))])
+
+/**
+ * @Internal: Random numbers for the checks, the same on every run.
+ */
+static uint64_t
+cyaml_check_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+#define CYAML_CHECK_ENTRIES (3 * CYAML_HASH_BLOCK)
+#define CYAML_CHECK_BIG (3 * CYAML_HASH_BLOCK)
+
+/**
+ * @Internal: A document of the diff check: the mapping 'k0' ... of
+ * scalars, lists of 1 to 3 items and mappings of 'x', 'y' and 'z', more
+ * of them than fit a block of hashes, and the list 'big' of as many
+ * items.
+ */
+typedef struct cyaml_check_model_t {
+	struct {
+		int present;
+		int kind; /* enum cyaml_storage_type */
+		int size;
+		int values[3];
+	} entries[CYAML_CHECK_ENTRIES];
+	int big[CYAML_CHECK_BIG];
+} cyaml_check_model_t;
+
+/**
+ * @Internal: Lines of '+', '-' or '~' and a path, as reported by
+ * 'cyaml_diff' or expected from two models.
+ */
+typedef struct cyaml_check_lines_t {
+	char lines[4 * CYAML_CHECK_ENTRIES + CYAML_CHECK_BIG][64];
+	size_t size;
+	int stop; /* returned after this many reports, 0 never */
+} cyaml_check_lines_t;
+
+static void
+cyaml_check_line(cyaml_check_lines_t *lines, char op, const char *format, size_t i, size_t j)
+{
+	char path[48];
+	snprintf(path, sizeof(path), format, i, j);
+	snprintf(lines->lines[lines->size++], sizeof(*lines->lines), "%c %s", op, path);
+}
+
+static int
+cyaml_check_report(enum cyaml_diff_op op, char *path, cyaml_t *old_node, cyaml_t *new_node,
+		   void *data)
+{
+	cyaml_check_lines_t *lines = data;
+	(void) old_node;
+	(void) new_node;
+	if (lines->size < sizeof(lines->lines) / sizeof(*lines->lines)) {
+		snprintf(lines->lines[lines->size], sizeof(*lines->lines), "%c %s",
+			 op == CYAML_DIFF_ADDED ? '+' : op == CYAML_DIFF_REMOVED ? '-' : '~', path);
+	}
+	lines->size++;
+	return lines->stop && lines->size == (size_t) lines->stop ? lines->stop : 0;
+}
+
+static int
+cyaml_check_compare_lines(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+static int
+cyaml_check_same_lines(cyaml_check_lines_t *a, cyaml_check_lines_t *b)
+{
+	size_t i;
+	for (i = 0; i < a->size && a->size == b->size; i++) {
+		if (strcmp(a->lines[i], b->lines[i]) != 0) {
+			return 0;
+		}
+	}
+	return a->size == b->size;
+}
+
+/**
+ * @Internal: Writes 'model' as a document into 'text'.
+ */
+static size_t
+cyaml_check_model_text(cyaml_check_model_t *model, char *text)
+{
+	size_t i, len = 0;
+	int j;
+	for (i = 0; i < CYAML_CHECK_ENTRIES; i++) {
+		if (!model->entries[i].present) {
+			continue;
+		}
+
+		switch (model->entries[i].kind) {
+		case CYAML_STORAGE_SCALAR:
+			len += (size_t) sprintf(text + len, "k%zu: %d\n", i, model->entries[i].values[0]);
+			break;
+		case CYAML_STORAGE_LIST:
+			len += (size_t) sprintf(text + len, "k%zu:\n", i);
+			for (j = 0; j < model->entries[i].size; j++) {
+				len += (size_t) sprintf(text + len, "  - %d\n", model->entries[i].values[j]);
+			}
+			break;
+		default:
+			len += (size_t) sprintf(text + len, "k%zu:\n  x: %d\n  y: %d\n  z: %d\n", i,
+						model->entries[i].values[0], model->entries[i].values[1],
+						model->entries[i].values[2]);
+			break;
+		}
+	}
+
+	len += (size_t) sprintf(text + len, "big:\n");
+	for (i = 0; i < CYAML_CHECK_BIG; i++) {
+		len += (size_t) sprintf(text + len, "  - %d\n", model->big[i]);
+	}
+	return len;
+}
+
+/**
+ * @Internal: The lines 'cyaml_diff' has to report going from 'a' to 'b'.
+ */
+static void
+cyaml_check_model_diff(cyaml_check_model_t *a, cyaml_check_model_t *b, cyaml_check_lines_t *lines)
+{
+	static const char *keys[] = { "k%zu.x", "k%zu.y", "k%zu.z" };
+	size_t i, j;
+	lines->size = 0;
+	for (i = 0; i < CYAML_CHECK_ENTRIES; i++) {
+		if (!a->entries[i].present || !b->entries[i].present) {
+			if (a->entries[i].present || b->entries[i].present) {
+				cyaml_check_line(lines, a->entries[i].present ? '-' : '+', "k%zu", i, 0);
+			}
+		} else if (a->entries[i].kind != b->entries[i].kind
+			   || (a->entries[i].kind == CYAML_STORAGE_SCALAR
+			       && a->entries[i].values[0] != b->entries[i].values[0])) {
+			cyaml_check_line(lines, '~', "k%zu", i, 0);
+		} else if (a->entries[i].kind == CYAML_STORAGE_LIST) {
+			for (j = 0; j < (size_t) a->entries[i].size || j < (size_t) b->entries[i].size; j++) {
+				if (j >= (size_t) b->entries[i].size) {
+					cyaml_check_line(lines, '-', "k%zu[%zu]", i, j);
+				} else if (j >= (size_t) a->entries[i].size) {
+					cyaml_check_line(lines, '+', "k%zu[%zu]", i, j);
+				} else if (a->entries[i].values[j] != b->entries[i].values[j]) {
+					cyaml_check_line(lines, '~', "k%zu[%zu]", i, j);
+				}
+			}
+		} else if (a->entries[i].kind == CYAML_STORAGE_MAPPING) {
+			for (j = 0; j < 3; j++) {
+				if (a->entries[i].values[j] != b->entries[i].values[j]) {
+					cyaml_check_line(lines, '~', keys[j], i, 0);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < CYAML_CHECK_BIG; i++) {
+		if (a->big[i] != b->big[i]) {
+			cyaml_check_line(lines, '~', "big[%zu]", i, 0);
+		}
+	}
+	qsort(lines->lines, lines->size, sizeof(*lines->lines), cyaml_check_compare_lines);
+}
+
+/**
+ * @Internal: Makes random changes to random documents and checks that
+ * 'cyaml_diff' reports exactly those, for documents parsed with every
+ * pair of 'hash' options, hashes of blocks of items and entries
+ * included. A document differs from itself nowhere, and a report
+ * returning non-zero stops the walk.
+ */
+static void
+cyaml_check_diffs(void)
+{
+	static const enum cyaml_hashing hashes[] = { CYAML_HASH_64, CYAML_HASH_128, CYAML_HASH_NONE };
+	static cyaml_check_model_t models[2];
+	static cyaml_check_lines_t expected, reported;
+	cyaml_options_t options[2] = { { 0 }, { 0 } };
+	uint64_t state = 2685821657736338717ull;
+	size_t round, i, len[2], a, b;
+	cyaml_t *roots[2];
+	char *text[2];
+	int result;
+	text[0] = CYAML_MALLOC(1 << 20);
+	text[1] = CYAML_MALLOC(1 << 20);
+	if (!cyaml_check(text[0] && text[1], "diff check has memory")) {
+		CYAML_FREE(text[0]);
+		CYAML_FREE(text[1]);
+		return;
+	}
+
+	for (round = 0; round < 100; round++) {
+		for (i = 0; i < CYAML_CHECK_ENTRIES; i++) {
+			models[0].entries[i].present = cyaml_check_random(&state) % 8 != 0;
+			models[0].entries[i].kind = (int) (cyaml_check_random(&state) % 3);
+			models[0].entries[i].size = models[0].entries[i].kind == CYAML_STORAGE_LIST
+				? 1 + (int) (cyaml_check_random(&state) % 3) : 3;
+			models[0].entries[i].values[0] = (int) (cyaml_check_random(&state) % 4);
+			models[0].entries[i].values[1] = (int) (cyaml_check_random(&state) % 4);
+			models[0].entries[i].values[2] = (int) (cyaml_check_random(&state) % 4);
+		}
+		for (i = 0; i < CYAML_CHECK_BIG; i++) {
+			models[0].big[i] = (int) i;
+		}
+
+		/* a few changes, some rounds none at all, so that most blocks
+		 * stay the same */
+		models[1] = models[0];
+		for (i = cyaml_check_random(&state) % 8; i > 0; i--) {
+			a = cyaml_check_random(&state) % CYAML_CHECK_ENTRIES;
+			switch (cyaml_check_random(&state) % 4) {
+			case 0:
+				models[1].entries[a].present = !models[1].entries[a].present;
+				break;
+			case 1:
+				models[1].entries[a].kind = (models[1].entries[a].kind + 1) % 3;
+				models[1].entries[a].size = 3;
+				break;
+			case 2:
+				models[1].entries[a].values[cyaml_check_random(&state) % 3] += 1;
+				break;
+			default:
+				models[1].entries[a].size = models[1].entries[a].kind == CYAML_STORAGE_LIST
+					? 1 + (int) (cyaml_check_random(&state) % 3) : 3;
+				break;
+			}
+		}
+		if (round % 2) {
+			models[1].big[cyaml_check_random(&state) % CYAML_CHECK_BIG] = -1;
+		}
+
+		cyaml_check_model_diff(&models[0], &models[1], &expected);
+		len[0] = cyaml_check_model_text(&models[0], text[0]);
+		len[1] = cyaml_check_model_text(&models[1], text[1]);
+		for (a = 0; a < 3; a++) {
+			for (b = 0; b < 3; b++) {
+				options[0].hash = hashes[a];
+				options[1].hash = hashes[b];
+				roots[0] = cyaml_parse_opts(text[0], len[0], CYAML_LOC_MEMORY, &options[0]);
+				roots[1] = cyaml_parse_opts(text[1], len[1], CYAML_LOC_MEMORY, &options[1]);
+				reported.size = 0;
+				reported.stop = 0;
+				result = roots[0] && roots[1]
+					? cyaml_diff(roots[0], roots[1], cyaml_check_report, &reported) : -1;
+				qsort(reported.lines, reported.size, sizeof(*reported.lines),
+				      cyaml_check_compare_lines);
+				cyaml_check(result == 0 && cyaml_check_same_lines(&reported, &expected),
+					    "cyaml_diff reports what changed");
+
+				reported.size = 0;
+				cyaml_check(roots[0] && cyaml_diff(roots[0], roots[0], cyaml_check_report, &reported) == 0
+					    && reported.size == 0, "a document does not differ from itself");
+
+				reported.size = 0;
+				reported.stop = 1;
+				result = roots[0] && roots[1]
+					? cyaml_diff(roots[0], roots[1], cyaml_check_report, &reported) : -1;
+				cyaml_check(expected.size ? result == 1 && reported.size == 1 : result == 0,
+					    "a report returning non-zero stops cyaml_diff");
+				cyaml_free(roots[0]);
+				cyaml_free(roots[1]);
+			}
+		}
+	}
+	CYAML_FREE(text[0]);
+	CYAML_FREE(text[1]);
+}
+
+/**
+ * @Internal: Where the keys a walk visits are written, separated by
+ * commas, the walk being stopped with 7 at the 'stop'th key if set.
+ */
+typedef struct cyaml_check_keys_t {
+	char text[1024];
+	size_t len, count, stop;
+} cyaml_check_keys_t;
+
+static int
+cyaml_check_key(cyaml_dict_t *entry, void *data)
+{
+	cyaml_check_keys_t *keys = data;
+	size_t room = sizeof(keys->text) - keys->len;
+	keys->len += (size_t) snprintf(keys->text + keys->len, room, "%s%s",
+				       keys->len ? "," : "", entry->key);
+	if (keys->len >= sizeof(keys->text)) {
+		keys->len = sizeof(keys->text) - 1;
+	}
+	return ++keys->count == keys->stop ? 7 : 0;
+}
+
+/**
+ * @Internal: Runs a prefix walk, or a range walk if 'range' is set,
+ * and checks the keys it visited against 'expected'.
+ */
+static void
+cyaml_check_walk(cyaml_t *root, int range, const char *first, const char *last,
+		 const char *expected)
+{
+	cyaml_check_keys_t keys;
+	char what[128];
+	keys.len = 0;
+	keys.count = 0;
+	keys.stop = 0;
+	keys.text[0] = '\0';
+	if (range) {
+		cyaml_foreach_range(root, (char *) first, (char *) last, cyaml_check_key, &keys);
+		snprintf(what, sizeof(what), "cyaml_foreach_range [%s, %s) visits '%s'",
+			 first ? first : "NULL", last ? last : "NULL", expected);
+	} else {
+		cyaml_foreach_prefix(root, (char *) first, cyaml_check_key, &keys);
+		snprintf(what, sizeof(what), "cyaml_foreach_prefix '%s' visits '%s'",
+			 first ? first : "NULL", expected);
+	}
+	if (!cyaml_check(strcmp(keys.text, expected) == 0, what)
+	    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+		printf("%s\n", keys.text);
+	}
+}
+
+#define CYAML_CHECK_KEYS 64
+
+/**
+ * @Internal: Checks the prefix and range walks, first against a table
+ * of the edges of a fixed mapping, then against random mappings over a
+ * small alphabet where the keys to visit are found by comparing every
+ * key with the bounds, and last that a walk stops where its callback
+ * says so.
+ */
+static void
+cyaml_check_foreach(void)
+{
+	static char text[] =
+		"serviceb: 1\n"
+		"a: 2\n"
+		"\"abc\x01\": 3\n"
+		"abd: 4\n"
+		"ab: 5\n"
+		"\"service.\": 6\n"
+		"service.b: 7\n"
+		"b: 8\n"
+		"service: 9\n"
+		"\"\xc3\xa9\": 10\n"
+		"abc: 11\n"
+		"service.a: 12\n";
+	static const char *all = "a,ab,abc,abc\x01,abd,b,service,service.,service.a,service.b,serviceb,\xc3\xa9";
+	static const char *prefixes[][2] = {
+		{ "ab", "ab,abc,abc\x01,abd" },
+		{ "abc", "abc,abc\x01" },
+		{ "abc\x01", "abc\x01" },
+		{ "abcd", "" },
+		{ "service", "service,service.,service.a,service.b,serviceb" },
+		{ "service.", "service.,service.a,service.b" },
+		{ "\xc3", "\xc3\xa9" },
+		{ "x", "" }
+	};
+	static const char *ranges[][3] = {
+		{ "ab", "b", "ab,abc,abc\x01,abd" },
+		{ "abc", "abc\x01", "abc" },
+		{ "abc\x01", "abd", "abc\x01" },
+		{ "abc", "abc", "" },
+		{ "b", "a", "" },
+		{ "service", "service.", "service" },
+		{ "service.", "service/", "service.,service.a,service.b" },
+		{ NULL, "a", "" },
+		{ NULL, "ab", "a" },
+		{ "abd", NULL, "abd,b,service,service.,service.a,service.b,serviceb,\xc3\xa9" },
+		{ "z", NULL, "\xc3\xa9" },
+		{ "\xc3\xa9", NULL, "\xc3\xa9" },
+		{ "\xc3\xaa", NULL, "" },
+		{ "a", "a\x01", "a" },
+		{ "ab\x01", "abd\x01", "abc,abc\x01,abd" }
+	};
+	static const char alphabet[] = { 'a', 'b', '.', '\x01', '\xff' };
+	static char keys[CYAML_CHECK_KEYS][8], bounds[2][8];
+	static char document[CYAML_CHECK_KEYS * 16], expected[1024];
+	uint64_t state = 1442695040888963407ull;
+	size_t round, i, j, count, len, elen;
+	cyaml_check_keys_t walk;
+	const char *first, *last;
+	cyaml_t *root;
+	root = cyaml_parse(text, sizeof(text) - 1, CYAML_LOC_MEMORY);
+	if (!cyaml_check(root != NULL, "foreach document parses")) {
+		return;
+	}
+
+	cyaml_check_walk(root, 0, NULL, NULL, all);
+	cyaml_check_walk(root, 0, "", NULL, all);
+	for (i = 0; i < sizeof(prefixes) / sizeof(*prefixes); i++) {
+		cyaml_check_walk(root, 0, prefixes[i][0], NULL, prefixes[i][1]);
+	}
+	cyaml_check_walk(root, 1, NULL, NULL, all);
+	cyaml_check_walk(root, 1, "", NULL, all);
+	cyaml_check_walk(root, 1, "", "", "");
+	for (i = 0; i < sizeof(ranges) / sizeof(*ranges); i++) {
+		cyaml_check_walk(root, 1, ranges[i][0], ranges[i][1], ranges[i][2]);
+	}
+
+	for (i = 1; i <= 12; i += 11) {
+		walk.len = 0;
+		walk.count = 0;
+		walk.stop = i;
+		cyaml_check(cyaml_foreach_prefix(root, NULL, cyaml_check_key, &walk) == 7
+			    && walk.count == i, "a callback returning non-zero stops cyaml_foreach_prefix");
+		walk.len = 0;
+		walk.count = 0;
+		cyaml_check(cyaml_foreach_range(root, NULL, NULL, cyaml_check_key, &walk) == 7
+			    && walk.count == i, "a callback returning non-zero stops cyaml_foreach_range");
+	}
+	walk.len = 0;
+	walk.count = 0;
+	walk.stop = 3;
+	cyaml_check(cyaml_foreach_prefix(root, "service.", cyaml_check_key, &walk) == 7
+		    && strcmp(walk.text, "service.,service.a,service.b") == 0,
+		    "a prefix walk stops at its last key");
+	cyaml_free(root);
+
+	for (round = 0; round < 200; round++) {
+		/* random keys, sorted and without repeats */
+		count = 1 + cyaml_check_random(&state) % CYAML_CHECK_KEYS;
+		for (i = 0; i < count; i++) {
+			len = 1 + cyaml_check_random(&state) % 4;
+			for (j = 0; j < len; j++) {
+				keys[i][j] = CYAML_CHECK_PICK(alphabet, &state);
+			}
+			keys[i][len] = '\0';
+		}
+		qsort(keys, count, sizeof(*keys), cyaml_check_compare_lines);
+		for (i = j = 0; i < count; i++) {
+			if (j == 0 || strcmp(keys[j - 1], keys[i]) != 0) {
+				memmove(keys[j++], keys[i], sizeof(*keys));
+			}
+		}
+		count = j;
+
+		len = 0;
+		for (i = count; i > 0; i--) {
+			len += (size_t) sprintf(document + len, "\"%s\": %zu\n", keys[i - 1], i);
+		}
+		root = cyaml_parse(document, len, CYAML_LOC_MEMORY);
+		if (!cyaml_check(root != NULL, "random foreach document parses")) {
+			continue;
+		}
+
+		/* bounds next to the keys, around them or anywhere */
+		for (i = 0; i < 2; i++) {
+			strcpy(bounds[i], keys[cyaml_check_random(&state) % count]);
+			len = strlen(bounds[i]);
+			switch (cyaml_check_random(&state) % 4) {
+			case 0:
+				bounds[i][len - 1] = '\0';
+				break;
+			case 1:
+				bounds[i][len] = CYAML_CHECK_PICK(alphabet, &state);
+				bounds[i][len + 1] = '\0';
+				break;
+			case 2:
+				bounds[i][0] = CYAML_CHECK_PICK(alphabet, &state);
+				break;
+			default:
+				break;
+			}
+		}
+		first = cyaml_check_random(&state) % 8 ? bounds[0] : NULL;
+		last = cyaml_check_random(&state) % 8 ? bounds[1] : NULL;
+
+		elen = 0;
+		expected[0] = '\0';
+		for (i = 0; i < count; i++) {
+			if (strncmp(keys[i], bounds[0], strlen(bounds[0])) == 0) {
+				elen += (size_t) sprintf(expected + elen, "%s%s", elen ? "," : "", keys[i]);
+			}
+		}
+		cyaml_check_walk(root, 0, bounds[0], NULL, expected);
+
+		elen = 0;
+		expected[0] = '\0';
+		for (i = 0; i < count; i++) {
+			if ((!first || strcmp(keys[i], first) >= 0) && (!last || strcmp(keys[i], last) < 0)) {
+				elen += (size_t) sprintf(expected + elen, "%s%s", elen ? "," : "", keys[i]);
+			}
+		}
+		cyaml_check_walk(root, 1, first, last, expected);
+		cyaml_free(root);
+	}
+}
+
+#define CYAML_CHECK_ROWS 40
+#define CYAML_CHECK_COLUMNS 6
+
+/**
+ * @Internal: Checks the columnar view, first of random lists of
+ * mappings whose keys come in any order and whose values are of any
+ * length, against looking every value up in its row, then that lists
+ * it cannot be made of have none, and that a missing key has no column.
+ */
+static void
+cyaml_check_columns(void)
+{
+	static const char *pieces[] = { "", "x", "a b", "0", "long value of a row", "\"quoted: x\"" };
+	static const char *broken[] = {
+		"l: x\n",
+		"l:\n  a: 1\n",
+		"l:\n  - x\n  - y\n",
+		"l:\n  - x\n  - a: 1\n",
+		"l:\n  - a: 1\n  - x\n",
+		"l:\n  - a: 1\n    b: 2\n  - a: 3\n",
+		"l:\n  - a: 1\n  - a: 3\n    b: 4\n",
+		"l:\n  - a: 1\n    b: 2\n  - a: 3\n    c: 4\n",
+		"l:\n  - a: 1\n  - a:\n      - 2\n",
+		"l:\n  - a:\n      b: 1\n  - a: 2\n",
+		"l:\n  - a:\n      - 1\n"
+	};
+	static char text[CYAML_CHECK_ROWS * CYAML_CHECK_COLUMNS * 64];
+	uint64_t state = 6364136223846793005ull;
+	size_t round, rows, keys, order[CYAML_CHECK_COLUMNS], swap, i, j, k, len;
+	cyaml_columns_t *columns;
+	cyaml_column_t *column;
+	cyaml_t *root, *list, *value;
+	char key[16];
+	int ok;
+	for (round = 0; round < 100; round++) {
+		rows = 1 + cyaml_check_random(&state) % CYAML_CHECK_ROWS;
+		keys = 1 + cyaml_check_random(&state) % CYAML_CHECK_COLUMNS;
+		len = (size_t) sprintf(text, "l:\n");
+		for (i = 0; i < rows; i++) {
+			for (j = 0; j < keys; j++) {
+				order[j] = j;
+			}
+			for (j = keys; j > 1; j--) {
+				k = cyaml_check_random(&state) % j;
+				swap = order[j - 1];
+				order[j - 1] = order[k];
+				order[k] = swap;
+			}
+			for (j = 0; j < keys; j++) {
+				len += (size_t) sprintf(text + len, "  %s k%zu: %s\n", j ? " " : "-", order[j],
+							CYAML_CHECK_PICK(pieces, &state));
+			}
+		}
+		root = cyaml_parse(text, len, CYAML_LOC_MEMORY);
+		list = cyaml_lookup(root, "l");
+		columns = cyaml_columns(list);
+		ok = columns && columns->rows == rows && columns->size == keys;
+		for (j = 0; ok && j < keys; j++) {
+			snprintf(key, sizeof(key), "k%zu", j);
+			column = cyaml_column(columns, key);
+			ok = column && column->len == strlen(key) && strcmp(column->key, key) == 0;
+			for (i = 0; ok && i < rows; i++) {
+				value = cyaml_lookup(list->storage.items[i], key);
+				ok = CYAML_COLUMN_LENGTH(column, i) == value->size
+					&& strcmp(CYAML_COLUMN_VALUE(column, i), value->storage.scalar) == 0;
+			}
+		}
+		if (!cyaml_check(ok, "every column holds the value of every row")
+		    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+			printf("%s\n", text);
+		}
+		cyaml_check(cyaml_column(columns, "k") == NULL && cyaml_column(columns, "k0x") == NULL
+			    && cyaml_column(columns, "missing") == NULL && cyaml_column(columns, NULL) == NULL,
+			    "a key the rows do not have has no column");
+		cyaml_columns_free(columns);
+		cyaml_free(root);
+	}
+
+	for (i = 0; i < sizeof(broken) / sizeof(*broken); i++) {
+		root = cyaml_parse((char *) broken[i], strlen(broken[i]), CYAML_LOC_MEMORY);
+		columns = cyaml_columns(cyaml_lookup(root, "l"));
+		if (!cyaml_check(root && !columns && cyaml_check_error("Columns need"),
+				 "a list of differing rows has no columns")
+		    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+			printf("%s\n", broken[i]);
+		}
+		cyaml_columns_free(columns);
+		cyaml_free(root);
+	}
+	cyaml_check(cyaml_columns(NULL) == NULL && cyaml_check_error("Columns need")
+		    && cyaml_column(NULL, "k0") == NULL, "no list has no columns");
+}
+
+/**
+ * @Internal: Checks that a lookup from a document freed and parsed
+ * again at the same address, here in the same buffer, is never answered
+ * with what the one before remembered, and that with CYAML_LOOKUP_CACHE
+ * parsing and freeing another document does not forget it.
+ */
+static void
+cyaml_check_lookups(void)
+{
+	static char first[] = "a: 1\nb: 2\n", second[] = "b: 3\na: 4\n";
+	static uint64_t memory[1024];
+	cyaml_options_t options = { 0 };
+	cyaml_t *root, *again, *found;
+#if CYAML_LOOKUP_CACHE
+	static char other[] = "a: 5\n";
+	cyaml_lookup_entry_t *entry = NULL;
+	size_t i;
+#endif /* CYAML_LOOKUP_CACHE */
+	options.buffer = memory;
+	options.buffer_size = sizeof(memory);
+	root = cyaml_parse_opts(first, sizeof(first) - 1, CYAML_LOC_MEMORY, &options);
+	found = cyaml_lookup(root, "a");
+	if (!cyaml_check(found && strcmp(found->storage.scalar, "1") == 0, "lookup document parses")) {
+		return;
+	}
+
+#if CYAML_LOOKUP_CACHE
+	/* a remembered lookup is found by its answer being swapped */
+	for (i = 0; i < CYAML_LOOKUP_CACHE; i++) {
+		if (cyaml_lookup_cache[i].cyaml == root && strcmp(cyaml_lookup_cache[i].path, "a") == 0) {
+			entry = &cyaml_lookup_cache[i];
+		}
+	}
+	cyaml_check(entry != NULL, "a lookup from the root is remembered");
+	cyaml_free(cyaml_parse(other, sizeof(other) - 1, CYAML_LOC_MEMORY));
+	if (entry) {
+		entry->result = cyaml_lookup_path(root, "b");
+		found = cyaml_lookup(root, "a");
+		cyaml_check(found == entry->result, "parsing and freeing another document keeps lookups");
+		entry->result = cyaml_lookup_path(root, "a");
+	}
+#endif /* CYAML_LOOKUP_CACHE */
+
+	cyaml_free(root);
+	again = cyaml_parse_opts(second, sizeof(second) - 1, CYAML_LOC_MEMORY, &options);
+	found = cyaml_lookup(again, "a");
+	cyaml_check(again == root, "a document parsed into the same buffer is at the same address");
+	cyaml_check(found && strcmp(found->storage.scalar, "4") == 0,
+		    "a lookup misses after the document was freed and parsed again");
+	cyaml_free(again);
+}
+
+#ifdef CYAML_HAVE_MMAP
+/**
+ * @Internal: Reads the header of the image at 'path' into 'header', or
+ * writes 'header' there if 'store' is set.
+ */
+static int
+cyaml_check_image(char *path, cyaml_cache_t *header, int store)
+{
+	ssize_t done;
+	int fd;
+	fd = open(path, store ? O_WRONLY : O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+
+	done = store ? pwrite(fd, header, sizeof(*header), CYAML_CHUNK_HEADER)
+		: pread(fd, header, sizeof(*header), CYAML_CHUNK_HEADER);
+	close(fd);
+	return done == (ssize_t) sizeof(*header);
+}
+
+/**
+ * @Internal: Checks the parse cache in a directory of its own: a miss
+ * adds the image and a hit maps an equal document, also when the same
+ * image is mapped twice and the second has to be relocated. Images
+ * with a wrong magic or size, or cut short, are parsed again instead.
+ */
+static void
+cyaml_check_cache(void)
+{
+	static const char *damages[] = {
+		"an image with a wrong magic",
+		"an image with a wrong size",
+		"an image cut short",
+		"an image cut short with its size"
+	};
+	char dir[] = "/tmp/cyaml-check-XXXXXX", path[CYAML_MAX_PATH], what[128], *text;
+	cyaml_options_t options = { 0 }, resolved;
+	cyaml_t *plain, *first, *second, *found;
+	cyaml_cache_t header;
+	uint64_t key, key_high;
+	struct stat st;
+	size_t len, i;
+	text = CYAML_MALLOC(1 << 16);
+	if (!cyaml_check(text && mkdtemp(dir), "cache check has a directory")) {
+		CYAML_FREE(text);
+		return;
+	}
+
+	len = 0;
+	for (i = 0; i < 200; i++) {
+		len += (size_t) sprintf(text + len, "k%zu:\n  - %zu\n  - v%zu\n", i, i, i);
+	}
+	options.cache = dir;
+	cyaml_options_resolve(&resolved, &options);
+	key = cyaml_cache_key(text, len, &resolved, &key_high);
+	snprintf(path, sizeof(path), "%s/%016llx%016llx.cyaml", dir,
+		 (unsigned long long) key_high, (unsigned long long) key);
+	plain = cyaml_parse(text, len, CYAML_LOC_MEMORY);
+
+	first = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+	cyaml_check(cyaml_check_image(path, &header, 0), "a cache miss adds the image");
+	cyaml_check_same(plain, first, "a cache miss parses the document", text);
+
+	/* both stay mapped, so the second cannot go where the first went */
+	first = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+	second = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+	cyaml_check(first && second && first != second
+		    && (uintptr_t) CYAML_DOC(second) - header.doc != header.base,
+		    "an image mapped twice is relocated");
+	found = cyaml_lookup(second, "k123");
+	cyaml_check(found && found->type == CYAML_STORAGE_LIST && found->size == 2
+		    && strcmp(found->storage.items[1]->storage.scalar, "v123") == 0,
+		    "a relocated image is looked up");
+	cyaml_check_same(plain, first, "a cache hit maps the document", text);
+	cyaml_check_same(plain, second, "a relocated cache hit maps the document", text);
+
+	for (i = 0; i < sizeof(damages) / sizeof(*damages); i++) {
+		if (!cyaml_check_image(path, &header, 0)) {
+			break;
+		}
+
+		switch (i) {
+		case 0:
+			header.magic++;
+			break;
+		case 1:
+			header.size++;
+			break;
+		default:
+			header.size /= 2;
+			if (truncate(path, (off_t) header.size) != 0) {
+				continue;
+			}
+			if (i == 2) {
+				header.size *= 2;
+			}
+			break;
+		}
+		cyaml_check_image(path, &header, 1);
+		snprintf(what, sizeof(what), "%s is parsed again", damages[i]);
+		cyaml_check_same(plain, cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options), what, text);
+		snprintf(what, sizeof(what), "%s is replaced", damages[i]);
+		cyaml_check(cyaml_check_image(path, &header, 0) && stat(path, &st) == 0
+			    && header.magic == CYAML_CACHE_MAGIC + sizeof(void *)
+			    && header.size == (uint64_t) st.st_size, what);
+	}
+
+	unlink(path);
+	rmdir(dir);
+	cyaml_free(plain);
+	CYAML_FREE(text);
+}
+#endif /* CYAML_HAVE_MMAP */
+
+/**
+ * @Internal: The random documents of the differential check are lines
+ * of an item or an entry with a key of its own, indented as deep as
+ * the line before or less, or deeper after an empty value that opens a
+ * block. Every level is a list or a mapping, but now and then a line
+ * takes the wrong one, a key repeats, a stray indentation comes first
+ * or a piece close to some corner of the grammar is appended.
+ */
+static const char *cyaml_check_indents[] = { " ", "   ", "\t", "  \t" };
+
+static const char *cyaml_check_values[] = {
+	"", "", "", "1", "two words", "\"x\"", "\"a\\\"b\"", "\"\\\\\"", "x:y",
+	"${HOME}", "v # c", "\"two\nlines\"", "- b", "k: v", "\"\"", "#"
+};
+
+static const char *cyaml_check_pieces[] = {
+	"- ", ":", ": ", " ", "\t", "\"", "\\", "#", "x:y", "\n", "!include a"
+};
+
+/**
+ * @Internal: Loads 'text' through 'cyaml_load_commit' in random pieces
+ * and 'cyaml_load_step'.
+ */
+static cyaml_t *
+cyaml_check_load(char *text, size_t len, uint64_t *state)
+{
+	cyaml_load_t *load;
+	size_t done = 0, room, n;
+	char *buffer;
+	load = cyaml_load_create(NULL);
+	while (done < len) {
+		buffer = cyaml_load_buffer(load, &room);
+		if (!buffer) {
+			return cyaml_load_finish(load);
+		}
+		n = 1 + cyaml_check_random(state) % 37;
+		n = n < room ? n : room;
+		n = n < len - done ? n : len - done;
+		memcpy(buffer, text + done, n);
+		if (!cyaml_load_commit(load, n)) {
+			return cyaml_load_finish(load);
+		}
+		done += n;
+	}
+
+	if (cyaml_load_commit(load, 0)) {
+		while (cyaml_load_step(load) == CYAML_AGAIN);
+	}
+	return cyaml_load_finish(load);
+}
+
+/**
+ * @Internal: Parses 'text' with 'cyaml_parse_step', yielding every
+ * 'budget' bytes.
+ */
+static cyaml_t *
+cyaml_check_step(char *text, size_t len, size_t budget)
+{
+	cyaml_parse_t *parse;
+	parse = cyaml_parse_begin(text, len, CYAML_LOC_MEMORY, NULL);
+	while (cyaml_parse_step(parse, budget) == CYAML_AGAIN);
+	return cyaml_parse_finish(parse);
+}
+
+/**
+ * @Internal: Parses 'text' into a buffer of the size
+ * 'cyaml_parse_size' asks for, which fails alike for a document that
+ * does not parse.
+ */
+static cyaml_t *
+cyaml_check_buffer(char *text, size_t len, void *memory, size_t capacity)
+{
+	cyaml_options_t options = { 0 };
+	options.buffer_size = cyaml_parse_size(text, len, CYAML_LOC_MEMORY, NULL);
+	if (!options.buffer_size || options.buffer_size > capacity) {
+		return NULL;
+	}
+	options.buffer = memory;
+	return cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+}
+
+#define CYAML_CHECK_TOKENS (1 << 13)
+
+/**
+ * @Internal: Tokenizes 'text' with 'cyaml_tokenize' and with
+ * 'cyaml_tokenize_packed', each a random few tokens at a time, and
+ * returns whether they report the same tokens, the packed ones as far
+ * as they get: an ERROR packed token stands for one that does not fit.
+ */
+static int
+cyaml_check_tokens(char *text, size_t len, uint64_t *state)
+{
+	static cyaml_lexeme_t lexemes[CYAML_CHECK_TOKENS];
+	static cyaml_packed_t packed[CYAML_CHECK_TOKENS];
+	cyaml_tokenizer_t *tokenizer;
+	size_t size = 0, packed_size = 0, n, i;
+	tokenizer = cyaml_tokenizer_create(text, len);
+	do {
+		n = cyaml_tokenize(tokenizer, lexemes + size,
+				   1 + cyaml_check_random(state) % 8 % (CYAML_CHECK_TOKENS - size));
+		size += n;
+	} while (n && size < CYAML_CHECK_TOKENS);
+	cyaml_tokenizer_free(tokenizer);
+
+	tokenizer = cyaml_tokenizer_create(text, len);
+	do {
+		n = cyaml_tokenize_packed(tokenizer, packed + packed_size,
+					  1 + cyaml_check_random(state) % 8 % (CYAML_CHECK_TOKENS - packed_size));
+		packed_size += n;
+	} while (n && packed_size < CYAML_CHECK_TOKENS);
+	cyaml_tokenizer_free(tokenizer);
+	cyaml_log_stack_size = 0;
+
+	for (i = 0; i < size && i < packed_size; i++) {
+		if (CYAML_PACKED_TYPE(packed[i]) == CYAML_TOKEN_ERROR && lexemes[i].type != CYAML_TOKEN_ERROR) {
+			return i + 1 == packed_size && packed[i].offset == lexemes[i].offset
+				&& (lexemes[i].offset > UINT32_MAX || lexemes[i].len >= CYAML_PACKED_WIDE);
+		}
+
+		if (CYAML_PACKED_TYPE(packed[i]) != lexemes[i].type || packed[i].offset != lexemes[i].offset
+		    || (lexemes[i].type != CYAML_TOKEN_ERROR && CYAML_PACKED_LEN(packed[i]) != lexemes[i].len)) {
+			return 0;
+		}
+	}
+	return size == packed_size;
+}
+
+/**
+ * @Internal: Checks the tokens of CYAML_PACKED_WIDE bytes or more, 16 MB,
+ * that the parser keeps whole next to its ring of packed tokens and
+ * that 'cyaml_tokenize_packed' stops at, with a scalar one byte shorter
+ * being packed as usual.
+ */
+static void
+cyaml_check_wide(void)
+{
+	cyaml_tokenizer_t *tokenizer;
+	cyaml_lexeme_t lexemes[16];
+	cyaml_packed_t packed[16];
+	size_t len, size, i;
+	cyaml_t *root, *a, *b;
+	uint64_t state = 1;
+	char *text;
+	len = 2 * (size_t) CYAML_PACKED_WIDE + 16;
+	text = CYAML_MALLOC(len + 1);
+	if (!cyaml_check(text != NULL, "wide token check has memory")) {
+		return;
+	}
+
+	memcpy(text, "b: ", 3);
+	memset(text + 3, 'y', CYAML_PACKED_WIDE - 1);
+	len = 3 + CYAML_PACKED_WIDE - 1;
+	memcpy(text + len, "\na: ", 4);
+	len += 4;
+	memset(text + len, 'x', CYAML_PACKED_WIDE);
+	len += CYAML_PACKED_WIDE;
+	memcpy(text + len, "\nc: z\n", 7);
+	len += 6;
+
+	root = cyaml_parse(text, len, CYAML_LOC_MEMORY);
+	a = cyaml_lookup(root, "a");
+	b = cyaml_lookup(root, "b");
+	cyaml_check(a && a->size == CYAML_PACKED_WIDE && a->storage.scalar[CYAML_PACKED_WIDE - 1] == 'x'
+		    && b && b->size == CYAML_PACKED_WIDE - 1 && b->storage.scalar[0] == 'y'
+		    && cyaml_lookup(root, "c") != NULL, "a wide scalar is parsed whole");
+	cyaml_free(root);
+
+	tokenizer = cyaml_tokenizer_create(text, len);
+	size = cyaml_tokenize(tokenizer, lexemes, sizeof(lexemes) / sizeof(*lexemes));
+	cyaml_tokenizer_free(tokenizer);
+	for (i = 0; i < size && lexemes[i].len != CYAML_PACKED_WIDE; i++);
+	cyaml_check(i < size && lexemes[i].offset == 3 + CYAML_PACKED_WIDE - 1 + 4,
+		    "cyaml_tokenize reports a wide token");
+
+	tokenizer = cyaml_tokenizer_create(text, len);
+	size = cyaml_tokenize_packed(tokenizer, packed, sizeof(packed) / sizeof(*packed));
+	cyaml_tokenizer_free(tokenizer);
+	cyaml_check(size == i + 1 && CYAML_PACKED_TYPE(packed[i]) == CYAML_TOKEN_ERROR
+		    && cyaml_check_error("Token does not fit in a packed token!"),
+		    "cyaml_tokenize_packed stops at a wide token");
+	cyaml_check(cyaml_check_tokens(text, len, &state), "cyaml_tokenize_packed agrees up to a wide token");
+	CYAML_FREE(text);
+}
+
+/**
+ * @Internal: Parses CYAML_CHECK_INPUTS random documents with
+ * 'cyaml_parse' and checks that 'cyaml_validate', the load API,
+ * 'cyaml_parse_step', a buffer of the caller's, 'share' and a
+ * pipelined parse of the document written to a file all agree with it,
+ * as do the packed and the plain tokens. 'cyaml_validate' does not look for duplicate keys, so it may accept
+ * a document that fails to parse for them.
+ */
+static void
+cyaml_check_differential(void)
+{
+	static char memory[1 << 20];
+	cyaml_options_t options = { 0 };
+	cyaml_t *plain, *other;
+	uint64_t state = 88172645463325252ull;
+	size_t i, k, lines, len, level;
+	const char *value;
+	unsigned char lists[16];
+	char text[4096], path[] = "/tmp/cyaml_check_XXXXXX", error[CYAML_LOG_MESSAGE_CAPACITY];
+	FILE *file;
+	size_t written;
+	int fd, valid;
+	fd = mkstemp(path);
+	if (fd < 0) {
+		cyaml_check(0, "differential check creates a file");
+		return;
+	}
+	close(fd);
+
+	for (i = 0; i < CYAML_CHECK_INPUTS; i++) {
+		lines = 1 + cyaml_check_random(&state) % 24;
+		lists[0] = cyaml_check_random(&state) % 2;
+		for (k = 0, len = 0, level = 0, value = "-"; k < lines; k++) {
+			if (!value[0] && level + 1 < sizeof(lists) / sizeof(*lists)) {
+				lists[++level] = cyaml_check_random(&state) % 2;
+			} else {
+				level = cyaml_check_random(&state) % (level + 1);
+			}
+
+			if (cyaml_check_random(&state) % 16 == 0) {
+				len += (size_t) sprintf(text + len, "%s", CYAML_CHECK_PICK(cyaml_check_indents, &state));
+			}
+			len += (size_t) sprintf(text + len, "%*s", (int) (2 * level), "");
+			if (lists[level] ^ (cyaml_check_random(&state) % 16 == 0)) {
+				len += (size_t) sprintf(text + len, "- ");
+			} else {
+				len += (size_t) sprintf(text + len, "k%zu: ", cyaml_check_random(&state) % 16 ? k : 0);
+			}
+			value = CYAML_CHECK_PICK(cyaml_check_values, &state);
+			len += (size_t) sprintf(text + len, "%s%s\n", value,
+				cyaml_check_random(&state) % 16 ? "" : CYAML_CHECK_PICK(cyaml_check_pieces, &state));
+		}
+
+		plain = cyaml_parse(text, len, CYAML_LOC_MEMORY);
+		snprintf(error, sizeof(error), "%s", plain ? "" : cyaml_error_pop());
+		cyaml_log_stack_size = 0;
+		valid = cyaml_validate(text, len, NULL);
+		if (!cyaml_check(plain ? valid : !valid || strncmp(error, "Duplicate key", 13) == 0,
+				 "cyaml_validate agrees with cyaml_parse")
+		    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+			printf("%s\n", text);
+		}
+
+		if (!cyaml_check(cyaml_check_tokens(text, len, &state),
+				 "cyaml_tokenize_packed agrees with cyaml_tokenize")
+		    && cyaml_check_failures <= CYAML_CHECK_REPORTS) {
+			printf("%s\n", text);
+		}
+
+		other = cyaml_check_load(text, len, &state);
+		cyaml_check_same(plain, other, "the load API agrees with cyaml_parse", text);
+		other = cyaml_check_step(text, len, cyaml_check_random(&state) % 8);
+		cyaml_check_same(plain, other, "cyaml_parse_step agrees with cyaml_parse", text);
+		other = cyaml_check_buffer(text, len, memory, sizeof(memory));
+		cyaml_check_same(plain, other, "a buffer of the caller's agrees with cyaml_parse", text);
+
+		options.share = 1;
+		other = cyaml_parse_opts(text, len, CYAML_LOC_MEMORY, &options);
+		cyaml_check_same(plain, other, "share agrees with cyaml_parse", text);
+		options.share = 0;
+
+		file = fopen(path, "wb");
+		written = file ? fwrite(text, 1, len, file) : 0;
+		if (!file || fclose(file) != 0 || written != len) {
+			cyaml_check(0, "differential check writes a file");
+			break;
+		}
+		options.pipeline = 1;
+		other = cyaml_parse_opts(path, strlen(path), CYAML_LOC_DISK, &options);
+		cyaml_check_same(plain, other, "pipeline agrees with cyaml_parse", text);
+		options.pipeline = 0;
+
+		cyaml_free(plain);
+		cyaml_log_stack_size = 0;
+	}
+	remove(path);
+}
+
+/**
+ * Runs every check against the 'tests' directory given (or './tests'),
+ * exiting with 1 if any of them failed.
+ */
+int
+main(int argc, char **argv)
+{
+	char *tests = argc > 1 ? argv[1] : "tests";
+	cyaml_check_includes(tests);
+	cyaml_check_names();
+	cyaml_check_queries();
+	cyaml_check_foreach();
+	cyaml_check_columns();
+	cyaml_check_lookups();
+#if defined(CYAML_HAVE_MMAP) && CYAML_CHECK_CACHE
+	cyaml_check_cache();
+#endif /* CYAML_CHECK_CACHE */
+	cyaml_check_diffs();
+	cyaml_check_wide();
+	cyaml_check_differential();
+	printf("%zu failures\n", cyaml_check_failures);
+	return cyaml_check_failures ? 1 : 0;
 }
+#endif /* CYAML_CHECK */
 
 #undef CYAML_TOKEN_STRINGP
 #undef CYAML_TOKEN_KEYP
@@ -387,7 +7827,13 @@ cyaml_free(cyaml_t *cyaml)
 #undef CYAML_TOKEN_COLONP
 #undef CYAML_TOKEN_INDENTP
 #undef CYAML_TOKEN_UNDENTP
+#undef CYAML_TOKEN_SPACEP
+#undef CYAML_TOKEN_LINEP
 #undef CYAML_TOKEN_DASHP
+#undef CYAML_TOKEN_ENDP
+#undef CYAML_TOKEN_ERRORP
+#undef CYAML_PARSER_GET
+#undef CYAML_PARSER_PEEK
 
 #endif /* CYAML_IMPLEMENTATION */
 #endif /* CYAML_H_ */